@@ -0,0 +1,579 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "main.h"
+#include "../trace.h"
+
+/* The library expects these to be exported */
+char *rx_ifname = "";
+char *tx_ifname = "";
+
+static struct settings settings = {
+	.window = 1000 * 1000 * 1000,
+};
+
+/* Timestamp source priority: hw > sw > user, see enum ts_src */
+#define SRC_NONE 0xff
+#define NSRC 3
+
+/* Bounds the time series: more means a broken trace or a window far
+ * too small for it */
+#define MAX_WINDOWS (1 << 20)
+
+static double pct[] = { 50, 90, 99, 99.9, 99.99 };
+
+struct trace_file {
+	const struct trace_hdr *hdr;
+	const struct trace_rec *rec;
+	size_t nr;
+};
+
+static struct trace_file txf, rxf;
+
+/*
+ * Work is split twice: first by file offset to find bounds and to
+ * partition records by sequence range, then by sequence range to
+ * join tx with rx.  Every stage is one call of run().
+ */
+
+static unsigned int nthreads;
+
+static void *xcalloc(size_t nr, size_t size)
+{
+	void *p = calloc(nr, size);
+
+	if (!p) {
+		ERR("can't allocate %zu x %zu bytes", nr, size);
+		exit(1);
+	}
+
+	return p;
+}
+
+static void run(void *(*fn)(void *), void *args, size_t size)
+{
+	pthread_t tid[nthreads];
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nthreads; ++i) {
+		err = pthread_create(tid + i, NULL, fn, args + i * size);
+		if (err) {
+			ERR("pthread_create: %s", strerror(err));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(tid[i], NULL);
+}
+
+/* i-th of nthreads equal parts of [0, nr) */
+static void split(size_t nr, unsigned int i, size_t *lo, size_t *hi)
+{
+	*lo = nr * i / nthreads;
+	*hi = nr * (i + 1) / nthreads;
+}
+
+/*
+ * Stage 1: bounds of every file chunk
+ */
+
+struct bounds {
+	const struct trace_file *f;
+	unsigned int i;
+
+	size_t nr;
+	uint32_t max_seq;
+	uint64_t min_ts[NSRC], max_ts[NSRC];	/* per source */
+};
+
+static void *bounds(void *arg)
+{
+	struct bounds *b = arg;
+	size_t lo, hi, j;
+
+	split(b->f->nr, b->i, &lo, &hi);
+
+	b->nr = hi - lo;
+	b->max_seq = 0;
+	for (j = 0; j < NSRC; ++j) {
+		b->min_ts[j] = UINT64_MAX;
+		b->max_ts[j] = 0;
+	}
+
+	for (j = lo; j < hi; ++j) {
+		const struct trace_rec *r = b->f->rec + j;
+
+		if (r->seq > b->max_seq)
+			b->max_seq = r->seq;
+		if (r->src >= NSRC)
+			continue;
+		if (r->ts < b->min_ts[r->src])
+			b->min_ts[r->src] = r->ts;
+		if (r->ts > b->max_ts[r->src])
+			b->max_ts[r->src] = r->ts;
+	}
+
+	return NULL;
+}
+
+/*
+ * Stage 2: partition records by sequence range
+ */
+
+static uint64_t range_len;	/* 2^32 with one thread */
+
+static inline unsigned int range_of(uint32_t seq)
+{
+	return seq / range_len;
+}
+
+struct part {
+	const struct trace_file *f;
+	unsigned int i;
+
+	size_t *count;		/* records of this chunk per range */
+	struct trace_rec **out;	/* where this chunk writes per range */
+};
+
+static void *count(void *arg)
+{
+	struct part *p = arg;
+	size_t lo, hi, j;
+
+	split(p->f->nr, p->i, &lo, &hi);
+	for (j = lo; j < hi; ++j)
+		p->count[range_of(p->f->rec[j].seq)]++;
+
+	return NULL;
+}
+
+static void *scatter(void *arg)
+{
+	struct part *p = arg;
+	size_t lo, hi, j;
+
+	split(p->f->nr, p->i, &lo, &hi);
+	for (j = lo; j < hi; ++j) {
+		const struct trace_rec *r = p->f->rec + j;
+
+		*p->out[range_of(r->seq)]++ = *r;
+	}
+
+	return NULL;
+}
+
+struct range {
+	struct trace_rec *rec;
+	size_t nr;
+};
+
+/* Split file into per range arrays, keeping the file order */
+static struct range *partition(const struct trace_file *f)
+{
+	struct part p[nthreads];
+	struct range *range;
+	unsigned int i, r;
+	size_t off;
+
+	range = xcalloc(nthreads, sizeof(*range));
+	for (i = 0; i < nthreads; ++i) {
+		p[i].f = f;
+		p[i].i = i;
+		p[i].count = xcalloc(nthreads, sizeof(*p[i].count));
+		p[i].out = xcalloc(nthreads, sizeof(*p[i].out));
+	}
+
+	run(count, p, sizeof(*p));
+
+	for (r = 0; r < nthreads; ++r) {
+		for (i = 0; i < nthreads; ++i)
+			range[r].nr += p[i].count[r];
+		range[r].rec = xcalloc(range[r].nr + 1, sizeof(*range[r].rec));
+
+		off = 0;
+		for (i = 0; i < nthreads; ++i) {
+			p[i].out[r] = range[r].rec + off;
+			off += p[i].count[r];
+		}
+	}
+
+	run(scatter, p, sizeof(*p));
+
+	for (i = 0; i < nthreads; ++i) {
+		free(p[i].count);
+		free(p[i].out);
+	}
+
+	return range;
+}
+
+/*
+ * Stage 3: join tx and rx in every sequence range
+ */
+
+struct window {
+	uint64_t tx, rx, over;
+	int64_t lat_sum, lat_max;
+};
+
+/* Of the time series, in the clock of the best tx source */
+static uint64_t t0, t1;
+static size_t windows_nr;
+
+struct join {
+	unsigned int i;
+	struct range tx, rx;
+
+	uint64_t sent, received, dups, unmatched, over, off_series;
+	int64_t *lat;		/* sorted latencies */
+	size_t lat_nr;
+	struct window *win;
+};
+
+struct slot {
+	uint64_t ts;
+	uint8_t src;
+};
+
+static int better(const struct trace_rec *r, const struct slot *s)
+{
+	if (s->src == SRC_NONE)
+		return 1;
+	if (r->src != s->src)
+		return r->src > s->src;
+	return r->ts < s->ts;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	int64_t x = *(int64_t *)a, y = *(int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void *join(void *arg)
+{
+	struct window none = {};
+	struct join *j = arg;
+	uint64_t lo = j->i * range_len;
+	struct slot *tx, *rx;
+	size_t k;
+
+	tx = xcalloc(range_len, sizeof(*tx));
+	rx = xcalloc(range_len, sizeof(*rx));
+	for (k = 0; k < range_len; ++k)
+		tx[k].src = rx[k].src = SRC_NONE;
+
+	for (k = 0; k < j->tx.nr; ++k) {
+		const struct trace_rec *r = j->tx.rec + k;
+		struct slot *s = tx + r->seq - lo;
+
+		if (better(r, s)) {
+			s->ts = r->ts;
+			s->src = r->src;
+		}
+	}
+
+	for (k = 0; k < j->rx.nr; ++k) {
+		const struct trace_rec *r = j->rx.rec + k;
+		struct slot *s = rx + r->seq - lo;
+
+		if (s->src != SRC_NONE) {
+			j->dups++;
+			continue;
+		}
+		s->ts = r->ts;
+		s->src = r->src;
+	}
+
+	j->win = xcalloc(windows_nr, sizeof(*j->win));
+	j->lat = xcalloc(j->rx.nr + 1, sizeof(*j->lat));
+
+	for (k = 0; k < range_len; ++k) {
+		struct window *w = &none;
+		int64_t lat;
+
+		if (tx[k].src == SRC_NONE) {
+			j->unmatched += rx[k].src != SRC_NONE;
+			continue;
+		}
+
+		/* A timestamp of another clock falls out of the series */
+		if (tx[k].ts >= t0 && tx[k].ts <= t1)
+			w = j->win + (tx[k].ts - t0) / settings.window;
+		else
+			j->off_series++;
+		j->sent++;
+		w->tx++;
+
+		if (rx[k].src == SRC_NONE)
+			continue;
+
+		lat = rx[k].ts - tx[k].ts;
+		j->lat[j->lat_nr++] = lat;
+		j->received++;
+		w->rx++;
+		w->lat_sum += lat;
+		if (w->rx == 1 || lat > w->lat_max)
+			w->lat_max = lat;
+		if (settings.threshold && lat > settings.threshold) {
+			j->over++;
+			w->over++;
+		}
+	}
+
+	qsort(j->lat, j->lat_nr, sizeof(*j->lat), lat_cmp);
+
+	free(tx);
+	free(rx);
+	return NULL;
+}
+
+/*
+ * Reordering: rx records that arrive after a higher sequence number.
+ * Needs the running maximum from the previous chunks, so it runs
+ * after bounds() on rx.
+ */
+
+struct reorder {
+	unsigned int i;
+	uint32_t max;		/* max seq before this chunk */
+	int seen;		/* anything before this chunk */
+	uint64_t nr;
+};
+
+static void *reorder(void *arg)
+{
+	struct reorder *o = arg;
+	size_t lo, hi, k;
+
+	split(rxf.nr, o->i, &lo, &hi);
+	for (k = lo; k < hi; ++k) {
+		uint32_t seq = rxf.rec[k].seq;
+
+		if (o->seen && seq < o->max)
+			o->nr++;
+		if (!o->seen || seq > o->max)
+			o->max = seq;
+		o->seen = 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Output
+ */
+
+/* Walk sorted latencies of all ranges in order and pick percentiles */
+static void percentiles(struct join *j, size_t total, int64_t *res)
+{
+	size_t pos[nthreads];
+	size_t n, p = 0;
+	unsigned int i;
+
+	memset(pos, 0, sizeof(pos));
+
+	for (n = 0; n < total && p < ARRAY_SIZE(pct); ++n) {
+		struct join *min = NULL;
+
+		for (i = 0; i < nthreads; ++i)
+			if (pos[i] < j[i].lat_nr &&
+			    (!min || j[i].lat[pos[i]] < min->lat[pos[min->i]]))
+				min = j + i;
+
+		while (p < ARRAY_SIZE(pct) &&
+		       n == (size_t)((total - 1) * pct[p] / 100))
+			res[p++] = min->lat[pos[min->i]];
+
+		pos[min->i]++;
+	}
+}
+
+static int map(const char *path, struct trace_file *f, enum trace_dir dir)
+{
+	f->hdr = trace_map(path, &f->nr);
+	if (!f->hdr)
+		return 1;
+
+	if (f->hdr->dir != dir) {
+		ERR("%s: expected %s trace", path, dir == TRACE_TX ? "tx" : "rx");
+		return 1;
+	}
+
+	f->rec = trace_recs(f->hdr);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t sent = 0, received = 0, dups = 0,
+		unmatched = 0, over = 0, reordered = 0;
+	uint64_t off_series = 0;
+	uint32_t max_seq = 0;
+	int64_t lat_sum = 0;
+	int src;
+	unsigned int i;
+	size_t k;
+	int err;
+
+	err = parse_argv(argc, argv, &settings);
+	if (err)
+		return err;
+
+	nthreads = settings.threads ?: sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (map(settings.tx_path, &txf, TRACE_TX) ||
+	    map(settings.rx_path, &rxf, TRACE_RX))
+		return 1;
+
+	if (!txf.nr) {
+		ERR("tx trace is empty");
+		return 1;
+	}
+
+	struct bounds txb[nthreads], rxb[nthreads];
+
+	for (i = 0; i < nthreads; ++i) {
+		txb[i] = (struct bounds){ .f = &txf, .i = i };
+		rxb[i] = (struct bounds){ .f = &rxf, .i = i };
+	}
+
+	run(bounds, txb, sizeof(*txb));
+	run(bounds, rxb, sizeof(*rxb));
+
+	for (i = 0; i < nthreads; ++i) {
+		if (txb[i].max_seq > max_seq)
+			max_seq = txb[i].max_seq;
+		if (rxb[i].max_seq > max_seq)
+			max_seq = rxb[i].max_seq;
+	}
+
+	/* Sources are different clocks: the series is in the best one */
+	for (src = NSRC - 1; src >= 0; --src) {
+		t0 = UINT64_MAX;
+		t1 = 0;
+		for (i = 0; i < nthreads; ++i) {
+			if (txb[i].min_ts[src] < t0)
+				t0 = txb[i].min_ts[src];
+			if (txb[i].max_ts[src] > t1)
+				t1 = txb[i].max_ts[src];
+		}
+		if (t0 <= t1)
+			break;
+	}
+
+	if (src < 0) {
+		ERR("no tx timestamps of a known source");
+		return 1;
+	}
+
+	if ((t1 - t0) / settings.window >= MAX_WINDOWS) {
+		ERR("tx timestamps span %llu windows, at most %u are allowed",
+		    (unsigned long long)((t1 - t0) / settings.window + 1),
+		    MAX_WINDOWS);
+		return 1;
+	}
+
+	range_len = (uint64_t)max_seq / nthreads + 1;
+	windows_nr = (t1 - t0) / settings.window + 1;
+
+	struct range *tx = partition(&txf);
+	struct range *rx = partition(&rxf);
+	struct join j[nthreads];
+	struct reorder o[nthreads];
+
+	for (i = 0; i < nthreads; ++i) {
+		j[i] = (struct join){ .i = i, .tx = tx[i], .rx = rx[i] };
+
+		o[i] = (struct reorder){ .i = i };
+		if (i) {
+			o[i].seen = o[i - 1].seen || rxb[i - 1].nr;
+			o[i].max = o[i - 1].max > rxb[i - 1].max_seq ?
+				o[i - 1].max : rxb[i - 1].max_seq;
+		}
+	}
+
+	run(join, j, sizeof(*j));
+	run(reorder, o, sizeof(*o));
+
+	for (i = 0; i < nthreads; ++i) {
+		sent += j[i].sent;
+		received += j[i].received;
+		dups += j[i].dups;
+		unmatched += j[i].unmatched;
+		over += j[i].over;
+		off_series += j[i].off_series;
+		reordered += o[i].nr;
+		for (k = 0; k < j[i].lat_nr; ++k)
+			lat_sum += j[i].lat[k];
+	}
+
+	printf("tx\t%llu\n", (unsigned long long)sent);
+	printf("rx\t%llu\n", (unsigned long long)received);
+	printf("lost\t%llu\n", (unsigned long long)(sent - received));
+	printf("loss\t%f\n", (double)(sent - received) / sent);
+	printf("duplicates\t%llu\n", (unsigned long long)dups);
+	printf("reordered\t%llu\n", (unsigned long long)reordered);
+	printf("unmatched\t%llu\n", (unsigned long long)unmatched);
+	if (off_series)
+		printf("off_series\t%llu\n", (unsigned long long)off_series);
+
+	if (received) {
+		int64_t res[ARRAY_SIZE(pct)], min = INT64_MAX, max = INT64_MIN;
+
+		percentiles(j, received, res);
+		for (i = 0; i < nthreads; ++i) {
+			if (!j[i].lat_nr)
+				continue;
+			if (j[i].lat[0] < min)
+				min = j[i].lat[0];
+			if (j[i].lat[j[i].lat_nr - 1] > max)
+				max = j[i].lat[j[i].lat_nr - 1];
+		}
+
+		printf("lat_min\t%f\n", min / 1e3);
+		printf("lat_avg\t%f\n", (double)lat_sum / received / 1e3);
+		for (k = 0; k < ARRAY_SIZE(pct); ++k)
+			printf("lat_p%g\t%f\n", pct[k], res[k] / 1e3);
+		printf("lat_max\t%f\n", max / 1e3);
+	}
+
+	if (settings.threshold)
+		printf("over_threshold\t%llu\n", (unsigned long long)over);
+
+	printf("# time(s)\t" "tx\t" "rx\t" "lost\t"
+	       "lat_avg(us)\t" "lat_max(us)%s\n",
+	       settings.threshold ? "\tover" : "");
+
+	for (k = 0; k < windows_nr; ++k) {
+		struct window w = {};
+
+		for (i = 0; i < nthreads; ++i) {
+			struct window *s = j[i].win + k;
+
+			if (s->rx && (!w.rx || s->lat_max > w.lat_max))
+				w.lat_max = s->lat_max;
+			w.tx += s->tx;
+			w.rx += s->rx;
+			w.over += s->over;
+			w.lat_sum += s->lat_sum;
+		}
+
+		printf("%f\t%llu\t%llu\t%llu\t%f\t%f",
+		       (double)k * settings.window / 1e9,
+		       (unsigned long long)w.tx, (unsigned long long)w.rx,
+		       (unsigned long long)(w.tx - w.rx),
+		       w.rx ? (double)w.lat_sum / w.rx / 1e3 : 0,
+		       w.lat_max / 1e3);
+		if (settings.threshold)
+			printf("\t%llu", (unsigned long long)w.over);
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#define ERR(str, ...) fprintf(stderr, "[ ERR] %s: %s: %d: "  str "\n", __FILE__, __func__, __LINE__, ##__VA_ARGS__)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*a))
+
+struct settings {
+	char *tx_path, *rx_path;
+	uint64_t window;	/* time series step, ns */
+	uint64_t threshold;	/* latency threshold, ns, 0 - off */
+	unsigned int threads;
+};
+
+int parse_argv(int argc, char **argv, struct settings *settings);
@@ -0,0 +1,94 @@
+#include <argp.h>
+#include <stdlib.h>
+
+#include "main.h"
+
+static void parse_uint(struct argp_state *state, char *arg, unsigned int *uint)
+{
+	int err;
+	err = sscanf(arg, "%u", uint);
+	if (err != 1)
+		argp_error(state, "invalid uint: %s", arg);
+}
+
+/* Parse microseconds into nanoseconds */
+static void parse_us(struct argp_state *state, char *arg, uint64_t *ns)
+{
+	double us;
+	int err;
+
+	err = sscanf(arg, "%lf", &us);
+	if (err != 1 || us < 0)
+		argp_error(state, "invalid time: %s", arg);
+
+	*ns = us * 1000;
+}
+
+enum analyzer_options {
+	opt_window = 0x100,
+	opt_threshold,
+	opt_threads,
+};
+
+static error_t parser(int key, char *arg, struct argp_state *state)
+{
+	struct settings *settings = state->input;
+
+	switch (key) {
+	case opt_window:
+		parse_us(state, arg, &settings->window);
+		if (!settings->window)
+			argp_error(state, "window can't be zero");
+		break;
+	case opt_threshold:
+		parse_us(state, arg, &settings->threshold);
+		break;
+	case opt_threads:
+		parse_uint(state, arg, &settings->threads);
+		if (!settings->threads)
+			argp_error(state, "at least one thread is needed");
+		break;
+	case ARGP_KEY_ARG:
+		if (state->arg_num == 0)
+			settings->tx_path = arg;
+		else if (state->arg_num == 1)
+			settings->rx_path = arg;
+		else
+			argp_usage(state);
+		break;
+	case ARGP_KEY_END:
+		if (state->arg_num < 2)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp_option options[] = {
+	{.name = "window", .key = opt_window, .arg = "us",
+	 .doc = "Time series step (default 1000000)"},
+	{.name = "threshold", .key = opt_threshold, .arg = "us",
+	 .doc = "Count frames with latency above this value"},
+	{.name = "threads", .key = opt_threads, .arg = "uint",
+	 .doc = "Number of worker threads (default: all cores)"},
+	{}
+};
+
+static char docstring[] =
+	"\nCompute loss, reordering, latency percentiles and time series "
+	"from tx/rx traces written by libframegen (see tx_trace/rx_trace).";
+
+static struct argp argp = {
+	.options = options,
+	.parser = parser,
+	.args_doc = "TX_TRACE RX_TRACE",
+	.doc = docstring,
+};
+
+int parse_argv(int argc, char **argv, struct settings *settings)
+{
+	return argp_parse(&argp, argc, argv, 0, NULL, settings);
+}
@@ -0,0 +1,226 @@
+/*
+ * Loopback benchmark: runs trials over a veth pair (see run.sh) for
+ * every frame size x packet rate and prints one JSON object per
+ * trial to stdout:
+ *
+ *   fsize, target_pps  - the point of the matrix
+ *   tx_pps, rx_pps     - achieved
+ *   rate_err           - (tx_pps - target_pps) / target_pps
+ *   lost               - sent, but not received
+ *   cpu_ns             - CPU time of tx and rx per sent frame
+ *   lat_us             - mean latency: the cost of the stack and ours
+ *   gap_src            - tx timestamps the pacing stats come from
+ *   gap_dev_ns         - mean deviation of the inter-departure time
+ *   gap_rms_ns           from the nominal one, and its RMS
+ *   gap_min_ns, gap_max_ns
+ *
+ * The slaves run as threads, so the CPU time of the process is
+ * theirs: the master only sleeps during a trial.  With -b mem they
+ * talk over the in-memory link, no veth or root needed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../export.h"
+#include "../master.h"
+
+char *tx_ifname = "bench0";
+char *rx_ifname = "bench1";
+int slave_threads = 1;
+char *io_backend;
+
+#define MAX_POINTS 16
+
+/* Frames without FCS, the veth MTU is 1500 */
+static const char *sizes_arg = "64,512,1514";
+static const char *rates_arg = "10000,50000,100000";
+static unsigned int duration = 2;
+
+static int parse_list(const char *arg, unsigned int *val)
+{
+	char *end;
+	int nr = 0;
+
+	while (*arg && nr < MAX_POINTS) {
+		val[nr] = strtoul(arg, &end, 10);
+		if (end == arg || !val[nr])
+			return -1;
+		++nr;
+		arg = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			return -1;
+	}
+
+	return *arg ? -1 : nr;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_time()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+/* The timestamp source with the most gaps, the best one on a tie */
+static const struct framegen_idt *best_idt(const struct framegen_dir_idt *idt,
+					   const char **name)
+{
+	static const char *names[] = { "user", "sw", "hw" };
+	int i, best = 2;
+
+	for (i = 1; i >= 0; --i)
+		if (idt->src[i].gaps > idt->src[best].gaps)
+			best = i;
+	*name = names[best];
+	return idt->src + best;
+}
+
+static int trial(rfc2544_ctrl_handler_t *h, unsigned int fsize,
+		 unsigned int pps)
+{
+	ethrate_t rate = {
+		.units = RATE_MBPS,
+		.val = pps * 8.0 * fsize / 1e6,
+	};
+	struct framegen_dir_stat stat[2];
+	struct framegen_dir_idt idt[2];
+	const struct framegen_idt *gap;
+	const char *gap_src;
+	double start, elapsed, cpu;
+	int err;
+
+	if (h->tx.conf_framesize(fsize) || h->tx.conf_rate(rate)) {
+		ERR("bad frame size %u or rate %u", fsize, pps);
+		return 1;
+	}
+
+	if (h->rx.start() || h->tx.start()) {
+		ERR("can't start the trial");
+		return 1;
+	}
+
+	start = now();
+	cpu = cpu_time();
+	sleep(duration);
+
+	/* rx too, whatever tx says: it would run forever otherwise */
+	err = h->tx.stop();
+	err |= h->rx.stop();
+	if (err) {
+		ERR("can't stop the trial");
+		return 1;
+	}
+	elapsed = now() - start;
+	cpu = cpu_time() - cpu;
+
+	if (framegen_get_stat(NULL, stat) || framegen_get_idt(NULL, idt)) {
+		ERR("can't get stats");
+		return 1;
+	}
+	gap = best_idt(idt, &gap_src);
+
+	printf("{\"fsize\": %u, \"target_pps\": %u, "
+	       "\"tx_pps\": %.1f, \"rx_pps\": %.1f, \"rate_err\": %.5f, "
+	       "\"lost\": %u, \"cpu_ns\": %.1f, \"lat_us\": %.3f, "
+	       "\"gap_src\": \"%s\", \"gap_dev_ns\": %.1f, \"gap_rms_ns\": %.1f, "
+	       "\"gap_min_ns\": %lld, \"gap_max_ns\": %lld}\n",
+	       fsize, pps, stat[0].tx / elapsed, stat[0].rx / elapsed,
+	       (stat[0].tx / elapsed - pps) / pps, stat[0].lost,
+	       stat[0].tx ? cpu * 1e9 / stat[0].tx : 0,
+	       stat[0].rx ? stat[0].lat * 1e6 / stat[0].rx : 0,
+	       gap_src, gap->dev_mean_ns, gap->dev_rms_ns,
+	       (long long)gap->min_ns, (long long)gap->max_ns);
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s sizes] [-p rates] [-t seconds] "
+		"[-b backend]\n"
+		"  -s  frame sizes, default %s\n"
+		"  -p  packet rates, pps, default %s\n"
+		"  -t  seconds per trial, default %u\n"
+		"  -b  socket or mem, default socket\n",
+		prog, sizes_arg, rates_arg, duration);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int sizes[MAX_POINTS], rates[MAX_POINTS];
+	int nr_sizes, nr_rates, i, j, opt, err = 0;
+	rfc2544_ctrl_handler_t handler;
+
+	while ((opt = getopt(argc, argv, "s:p:t:b:")) != -1) {
+		switch (opt) {
+		case 's':
+			sizes_arg = optarg;
+			break;
+		case 'p':
+			rates_arg = optarg;
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'b':
+			io_backend = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	nr_sizes = parse_list(sizes_arg, sizes);
+	nr_rates = parse_list(rates_arg, rates);
+	if (nr_sizes <= 0 || nr_rates <= 0 || !duration) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	header_cfg_t header = {
+		.eth = {
+			.h_dest = {0x02, 0, 0, 0, 0, 0x02},
+			.h_source = {0x02, 0, 0, 0, 0, 0x01},
+			.h_proto = htons(ETH_P_IP)
+		},
+		.ip = {
+			.version = 4,
+			.ihl = 5,
+			.ttl = 64,
+			.protocol = IPPROTO_UDP,
+			.saddr = htonl(10 << 24 | 1),
+			.daddr = htonl(10 << 24 | 2),
+		}
+	};
+
+	if (init_ctrl_handler(&handler, NULL)) {
+		ERR("can't init the generator");
+		return 1;
+	}
+
+	handler.tx.conf_flowid(1);
+	handler.tx.conf_header(&header);
+	handler.rx.conf_flowid(1);
+
+	for (i = 0; i < nr_sizes && !err; ++i)
+		for (j = 0; j < nr_rates && !err; ++j)
+			err = trial(&handler, sizes[i], rates[j]);
+
+	deinit_ctrl_handler();
+	return err;
+}
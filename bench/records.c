@@ -0,0 +1,305 @@
+/*
+ * Record micro-benchmark: times the stat path of the master on
+ * 10^3..10^max records in the orderings it gets:
+ *
+ *   mono     - ids in order, one record each (rx, tx with OPT_ID)
+ *   dup      - every id twice, blocks of user then kernel records
+ *   reorder  - ids in order but swapped within a small window
+ *
+ * Each (records, ordering) runs in a child of its own, so the peak
+ * RSS reported is that case's.  One JSON object per case to stdout,
+ * times in ns per record:
+ *
+ *   push      - fs_push() by the slave
+ *   ring      - ring_send() to ring_recv() between two threads, as
+ *               a snapshot goes from a slave to the master
+ *   sort      - fs_merge_tail() of a first snapshot
+ *   merge     - fs_merge_tail() of a snapshot after a sorted one
+ *   overlap   - the same, the snapshot has ids of the one before
+ *   latency   - fs_latency() of tx and rx records
+ *   rss_kb    - peak RSS
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <stdint.h>
+
+#include "../util.h"
+#include "../ring.h"
+
+#define DUP_BLOCK 64
+#define REORDER_WINDOW 8
+
+/* Small cases are repeated for up to this many records in total */
+#define MIN_TOTAL 1000000
+
+enum order {
+	ORDER_MONO,
+	ORDER_DUP,
+	ORDER_REORDER,
+	ORDER_NR,
+};
+
+static const char *order_name[] = {
+	[ORDER_MONO] = "mono",
+	[ORDER_DUP] = "dup",
+	[ORDER_REORDER] = "reorder",
+};
+
+static unsigned int max_exp = 7;
+
+enum op {
+	OP_PUSH,
+	OP_RING,
+	OP_SORT,
+	OP_MERGE,
+	OP_OVERLAP,
+	OP_LATENCY,
+	OP_NR,
+};
+
+static const char *op_name[] = {
+	[OP_PUSH] = "push",
+	[OP_RING] = "ring",
+	[OP_SORT] = "sort",
+	[OP_MERGE] = "merge",
+	[OP_OVERLAP] = "overlap",
+	[OP_LATENCY] = "latency",
+};
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Half of the windows, picked by a hash of the window number */
+static int reversed(int window)
+{
+	uint32_t h = window * 2654435761u;
+
+	return (h >> 16) & 1;
+}
+
+/* Record k of nr in the given ordering, ids start at base */
+static uint32_t gen_id(enum order order, int k, int nr, uint32_t base)
+{
+	int block, pos, win;
+
+	switch (order) {
+	case ORDER_DUP:
+		block = k / (2 * DUP_BLOCK);
+		pos = k % DUP_BLOCK;
+		return base + block * DUP_BLOCK + pos;
+	case ORDER_REORDER:
+		win = k / REORDER_WINDOW;
+		pos = k % REORDER_WINDOW;
+		if ((win + 1) * REORDER_WINDOW <= nr && reversed(win))
+			pos = REORDER_WINDOW - 1 - pos;
+		return base + win * REORDER_WINDOW + pos;
+	default:
+		return base + k;
+	}
+}
+
+static void gen_ts(uint32_t id, int copy, struct timespec *ts)
+{
+	uint64_t ns = 1000000000ull + id * 1000ull + copy * 500;
+
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/* Append nr records of the ordering to seg */
+static void build(struct fseg *seg, enum order order, int nr, uint32_t base)
+{
+	struct timespec ts;
+	uint32_t id;
+	int k;
+
+	for (k = 0; k < nr; ++k) {
+		id = gen_id(order, k, nr, base);
+		gen_ts(id, (k / DUP_BLOCK) & 1, &ts);
+		fs_push(seg, id, &ts, TS_SW);
+	}
+}
+
+struct sender {
+	struct ring *ring;
+	const struct fseg *seg;
+};
+
+static void *sender_main(void *arg)
+{
+	struct sender *s = arg;
+
+	ring_send(s->seg->rec, s->seg->len, s->ring);
+	ring_commit(s->ring);
+	return NULL;
+}
+
+/* One snapshot of seg through the ring into out, as slave_drain() */
+static double transfer(struct ring *ring, const struct fseg *seg,
+		       struct fseg *out)
+{
+	static const struct timespec poll = { .tv_nsec = 10 * 1000 * 1000 };
+	struct sender s = { .ring = ring, .seg = seg };
+	uint32_t req = ++ring->req;
+	pthread_t st;
+	double start;
+	int done;
+
+	start = now();
+	if (pthread_create(&st, NULL, sender_main, &s)) {
+		fprintf(stderr, "can't start the sender\n");
+		exit(1);
+	}
+
+	for (;;) {
+		done = ring_done(ring, req);
+		if (ring_recv(ring, out))
+			continue;
+		if (done)
+			break;
+		ring_wait(ring, req, &poll);
+	}
+
+	pthread_join(st, NULL);
+	return now() - start;
+}
+
+static void run_once(enum order order, int nr, struct ring *ring,
+		     double *ns)
+{
+	struct fseg a, b = {}, rx;
+	uint32_t i, old;
+	double start;
+
+	fs_init(&a);
+	start = now();
+	build(&a, order, nr, 0);
+	ns[OP_PUSH] += now() - start;
+
+	ns[OP_RING] += transfer(ring, &a, &b);
+	fs_free(&a);
+
+	start = now();
+	fs_merge_tail(&b, 0);
+	ns[OP_SORT] += now() - start;
+	fs_free(&b);
+
+	/* Two snapshots of half the trial each */
+	fs_init(&a);
+	build(&a, order, nr / 2, 0);
+	fs_merge_tail(&a, 0);
+	old = a.len;
+	build(&a, order, nr - nr / 2, nr / 2);
+	start = now();
+	fs_merge_tail(&a, old);
+	ns[OP_MERGE] += now() - start;
+
+	/* rx lost every 16th frame */
+	fs_init(&rx);
+	for (i = 0; i < a.len; ++i)
+		if (a.rec[i].id % 16)
+			fs_push(&rx, a.rec[i].id, &a.rec[i].ts, TS_SW);
+	start = now();
+	fs_latency(&rx, &a);
+	ns[OP_LATENCY] += now() - start;
+	fs_free(&rx);
+	fs_free(&a);
+
+	/* The second one starts with records of the first one's last
+	 * eighth: kernel timestamps that came after the snapshot */
+	fs_init(&a);
+	build(&a, order, nr / 2, 0);
+	fs_merge_tail(&a, 0);
+	old = a.len;
+	build(&a, order, nr - nr / 2, nr / 2 - nr / 16);
+	start = now();
+	fs_merge_tail(&a, old);
+	ns[OP_OVERLAP] += now() - start;
+	fs_free(&a);
+}
+
+static void run_case(enum order order, int nr)
+{
+	double ns[OP_NR] = {};
+	struct ring *ring;
+	struct rusage ru;
+	int rep, reps = nr < MIN_TOTAL ? MIN_TOTAL / nr : 1;
+	int i;
+
+	ring = ring_create(RING_ORDER, -1);
+	if (!ring)
+		exit(1);
+
+	for (rep = 0; rep < reps; ++rep)
+		run_once(order, nr, ring, ns);
+
+	ring_destroy(ring);
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("{\"records\": %d, \"order\": \"%s\"", nr, order_name[order]);
+	for (i = 0; i < OP_NR; ++i)
+		printf(", \"%s\": %.2f", op_name[i],
+		       ns[i] / reps / nr);
+	printf(", \"rss_kb\": %ld}\n", ru.ru_maxrss);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, nr, status;
+	unsigned int e;
+	enum order order;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm':
+			max_exp = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m max]\n"
+				"  -m  up to 10^max records, default %u\n",
+				argv[0], max_exp);
+			return 1;
+		}
+	}
+
+	if (max_exp < 3 || max_exp > 8) {
+		fprintf(stderr, "-m must be 3..8\n");
+		return 1;
+	}
+
+	for (e = 3, nr = 1000; e <= max_exp; ++e, nr *= 10) {
+		for (order = 0; order < ORDER_NR; ++order) {
+			pid = fork();
+			if (pid == -1)
+				return perror("fork"), 1;
+			if (!pid) {
+				run_case(order, nr);
+				exit(0);
+			}
+
+			if (waitpid(pid, &status, 0) == -1 ||
+			    !WIFEXITED(status) || WEXITSTATUS(status)) {
+				fprintf(stderr, "%d records, %s: failed\n",
+					nr, order_name[order]);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Runs bench on a veth pair in a private network namespace (needs
+# root), arguments go to bench.  JSON lines to stdout.
+
+bench=$(dirname "$0")/bench
+
+exec unshare -n sh -e -c '
+	ip link add bench0 type veth peer name bench1
+	ip link set dev bench0 up
+	ip link set dev bench1 up
+
+	# Wait for the carrier, frames sent before it are dropped
+	for i in $(seq 50); do
+		ip link show dev bench1 | grep -q LOWER_UP && break
+		sleep 0.1
+	done
+
+	exec "$0" "$@"' "$bench" "$@"
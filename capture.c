@@ -0,0 +1,298 @@
+#define _GNU_SOURCE /* IOV_MAX */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+
+#include <time.h>
+
+#include "debug.h"
+#include "trace.h"
+#include "pcap.h"
+
+/*
+ * Like the trace writer: rx fills one buffer while the writer thread
+ * owns the submitted ones.  A buffer is cut into slots as rx reserves
+ * them; only the committed ones get into its record list, the slots
+ * after the last of them go back at the next reserve.
+ */
+
+#define CAPTURE_BUFS 4
+#define CAPTURE_BUF_BYTES (4 << 20)
+#define CAPTURE_SNAP 2048	/* default */
+#define CAPTURE_MAX_SNAP 65535
+
+struct capture_buf {
+	int busy;		/* owned by the writer */
+	size_t used;
+	int len;
+	uint8_t *data;
+	struct iovec *rec;	/* committed records */
+};
+
+struct capture {
+	char path[PATH_MAX];
+	int fd;
+	unsigned int snap, slot;
+	uint64_t file_bytes;	/* 0 - one file, no limit */
+	unsigned int files;
+	unsigned int file;	/* files opened */
+	uint64_t written;	/* to the current one */
+
+	pthread_t writer;
+	sem_t ready;		/* number of buffers passed to the writer */
+	int stop;
+
+	int cur;		/* buffer being filled */
+	int next;		/* buffer the writer is waiting for */
+
+	struct capture_buf buf[CAPTURE_BUFS];
+};
+
+static int writev_all(int fd, struct iovec *iov, int nr)
+{
+	ssize_t err;
+
+	while (nr) {
+		err = writev(fd, iov, nr < IOV_MAX ? nr : IOV_MAX);
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (; nr && err >= iov->iov_len; ++iov, --nr)
+			err -= iov->iov_len;
+		if (err) {
+			iov->iov_base += err;
+			iov->iov_len -= err;
+		}
+	}
+
+	return 0;
+}
+
+/* Start the next file of the ring with its header */
+static int capture_file(struct capture *c)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC_NS,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = c->snap,
+		.linktype = LINKTYPE_ETHERNET,
+	};
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	char path[PATH_MAX + 16];
+
+	if (c->fd != -1)
+		close(c->fd);
+
+	if (c->file_bytes)
+		snprintf(path, sizeof(path), "%s.%u", c->path,
+			 c->file % c->files);
+	else
+		snprintf(path, sizeof(path), "%s", c->path);
+	c->file++;
+
+	c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (c->fd == -1) {
+		perror("open(capture)");
+		ERR("can't open %s", path);
+		return 1;
+	}
+
+	if (writev_all(c->fd, &iov, 1))
+		return perror("write(capture)"), 1;
+
+	c->written = sizeof(hdr);
+	return 0;
+}
+
+/* Write the records of a buffer, a new file whenever one is full */
+static int capture_write(struct capture *c, struct capture_buf *b)
+{
+	int i, start = 0;
+
+	for (i = 0; i < b->len; ++i) {
+		/* A record longer than a file still gets one */
+		if (c->file_bytes &&
+		    c->written > sizeof(struct pcap_file_hdr) &&
+		    c->written + b->rec[i].iov_len > c->file_bytes) {
+			if (writev_all(c->fd, b->rec + start, i - start) ||
+			    capture_file(c))
+				return 1;
+			start = i;
+		}
+		c->written += b->rec[i].iov_len;
+	}
+
+	return writev_all(c->fd, b->rec + start, i - start);
+}
+
+static void *writer(void *arg)
+{
+	struct capture *c = arg;
+	struct capture_buf *b;
+	int err = 0;
+
+	for (;;) {
+		while (sem_wait(&c->ready) && errno == EINTR)
+			;
+
+		b = c->buf + c->next;
+		if (!__atomic_load_n(&b->busy, __ATOMIC_ACQUIRE)) {
+			/* Woken up with nothing to write: capture_close() */
+			assert(__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE));
+			return NULL;
+		}
+
+		/* After an error keep emptying the buffers for rx */
+		if (!err && capture_write(c, b)) {
+			perror("write(capture)");
+			err = 1;
+		}
+
+		b->used = 0;
+		b->len = 0;
+		__atomic_store_n(&b->busy, 0, __ATOMIC_RELEASE);
+		c->next = (c->next + 1) % CAPTURE_BUFS;
+	}
+}
+
+static void capture_free(struct capture *c)
+{
+	int i;
+
+	if (c->fd != -1)
+		close(c->fd);
+
+	for (i = 0; i < CAPTURE_BUFS; ++i) {
+		free(c->buf[i].data);
+		free(c->buf[i].rec);
+	}
+	free(c);
+}
+
+struct capture *capture_open(const char *path, unsigned int snap,
+			     uint64_t file_bytes, unsigned int files)
+{
+	struct capture *c;
+	unsigned int room;
+	int i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return perror("calloc"), NULL;
+	c->fd = -1;
+
+	snprintf(c->path, sizeof(c->path), "%s", path);
+	c->snap = snap ? snap : CAPTURE_SNAP;
+	if (c->snap > CAPTURE_MAX_SNAP)
+		c->snap = CAPTURE_MAX_SNAP;
+	c->file_bytes = file_bytes;
+	c->files = files ? files : 2;
+
+	room = c->snap > CAPTURE_MIN_ROOM ? c->snap : CAPTURE_MIN_ROOM;
+	c->slot = (sizeof(struct pcap_rec_hdr) + room + 7) & ~7;
+
+	for (i = 0; i < CAPTURE_BUFS; ++i) {
+		c->buf[i].data = malloc(CAPTURE_BUF_BYTES);
+		c->buf[i].rec = calloc(CAPTURE_BUF_BYTES / c->slot,
+				       sizeof(*c->buf[i].rec));
+		if (!c->buf[i].data || !c->buf[i].rec) {
+			perror("malloc");
+			goto free;
+		}
+	}
+
+	if (capture_file(c))
+		goto free;
+
+	sem_init(&c->ready, 0, 0);
+	if (writer_start(&c->writer, writer, c)) {
+		sem_destroy(&c->ready);
+		goto free;
+	}
+
+	return c;
+
+free:
+	capture_free(c);
+	return NULL;
+}
+
+static void capture_submit(struct capture *c)
+{
+	struct capture_buf *b = c->buf + c->cur;
+
+	/* Nothing committed, or the writer's already */
+	if (__atomic_load_n(&b->busy, __ATOMIC_ACQUIRE) || !b->len)
+		return;
+
+	__atomic_store_n(&b->busy, 1, __ATOMIC_RELEASE);
+	sem_post(&c->ready);
+	c->cur = (c->cur + 1) % CAPTURE_BUFS;
+}
+
+int capture_reserve(struct capture *c, struct iovec *iov, int nr)
+{
+	struct capture_buf *b = c->buf + c->cur;
+	int i;
+
+	if (__atomic_load_n(&b->busy, __ATOMIC_ACQUIRE))
+		return 1;
+
+	/* The slots past the last committed one are free again */
+	b->used = b->len ? (uint8_t *)b->rec[b->len - 1].iov_base -
+		b->data + c->slot : 0;
+
+	if (b->used + nr * c->slot > CAPTURE_BUF_BYTES) {
+		capture_submit(c);
+		b = c->buf + c->cur;
+		if (__atomic_load_n(&b->busy, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+
+	for (i = 0; i < nr; ++i) {
+		iov[i].iov_base = b->data + b->used +
+			sizeof(struct pcap_rec_hdr);
+		iov[i].iov_len = c->slot - sizeof(struct pcap_rec_hdr);
+		b->used += c->slot;
+	}
+
+	return 0;
+}
+
+void capture_commit(struct capture *c, void *data, uint32_t len,
+		    const struct timespec *ts)
+{
+	struct capture_buf *b = c->buf + c->cur;
+	struct pcap_rec_hdr *rec = (struct pcap_rec_hdr *)data - 1;
+
+	rec->ts_sec = ts->tv_sec;
+	rec->ts_frac = ts->tv_nsec;
+	rec->caplen = len < c->snap ? len : c->snap;
+	rec->len = len;
+
+	b->rec[b->len++] = (struct iovec) { rec, sizeof(*rec) + rec->caplen };
+}
+
+void capture_close(struct capture *c)
+{
+	capture_submit(c);
+
+	__atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&c->ready);
+	pthread_join(c->writer, NULL);
+
+	sem_destroy(&c->ready);
+	capture_free(c);
+}
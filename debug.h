@@ -1,6 +1,6 @@
 #include <stdio.h>
 
-extern char *whoami;
+extern __thread char *whoami;
 
 #define PRNT(level, str, ...) fprintf(stderr, "%6s: [%5s] " __FILE__ ": "  str "\n", whoami, level, ##__VA_ARGS__)
 
@@ -10,4 +10,5 @@ extern char *whoami;
 #define INFO(...)
 #endif
 #define  ERR(...) PRNT("ERR", ##__VA_ARGS__)
+#define NOTE(...) PRNT("NOTE", ##__VA_ARGS__)
 
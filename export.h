@@ -1,2 +1,289 @@
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
 extern char *tx_ifname;
 extern char *rx_ifname;
+
+/*
+ * Optional settings, the library provides defaults
+ * if the program does not define them
+ */
+
+/* Per-frame binary traces (see trace.h), NULL disables.
+ * %u in the path is replaced with the trial number */
+extern char *tx_trace;
+extern char *rx_trace;
+
+/* Run tx and rx as threads of the program instead of
+ * forked processes.  The slaves then take over SIGALRM, SIGUSR1 and
+ * SIGUSR2 process wide: a handler the program installed before
+ * starting them is called for the signals sent to the process or to
+ * its own threads, SIG_IGN and SIG_DFL are not honoured any more */
+extern int slave_threads;
+
+/* CPU lists ("2", "4-5,7") to pin tx/rx to, NULL - no pinning */
+extern char *tx_cpus;
+extern char *rx_cpus;
+
+/* NUMA node for tx/rx and their buffers: NULL - the node of
+ * tx_ifname/rx_ifname from sysfs, "-1" - no placement.
+ * Without tx_cpus/rx_cpus the slave runs on the node's CPUs */
+extern char *tx_numa;
+extern char *rx_numa;
+
+/*
+ * Bidirectional mode: both interfaces send and receive at once.
+ * The reverse direction swaps MAC/IP addresses and UDP ports of the
+ * configured header and uses flowid | FRAMEGEN_REV_FLOW.  librfc2544
+ * callbacks start/stop both directions and report the forward one;
+ * framegen_get_stat() reports both.
+ */
+extern int bidirectional;
+
+#define FRAMEGEN_REV_FLOW 0x80000000u
+
+/* SCHED_FIFO priority of tx/rx, 0 - default scheduling.
+ * Also locks memory with mlockall().  Pin the slaves to
+ * isolated CPUs: tx never sleeps while a trial runs */
+extern int slave_rt_prio;
+
+/*
+ * Drain window.  rx.stop keeps rx receiving frames still in flight
+ * for up to rx_drain_us, or until no test frame has come for
+ * rx_idle_us, whichever ends first (0 - no such limit, both 0 - stop
+ * at once).  Stop tx first.  The time taken is reported in
+ * framegen_dir_stat.drain_ns.
+ */
+extern unsigned int rx_drain_us;
+extern unsigned int rx_idle_us;
+
+/*
+ * Payload timestamps: tx writes its send time (CLOCK_REALTIME) into
+ * each frame and rx computes the latency of every frame itself,
+ * against its software timestamp.  The slaves report totals only:
+ * no per-frame lists, no tx kernel timestamps, no join in the
+ * master.  Frames are 8 bytes longer at least.  Good for long
+ * trials; the latency includes the sendmsg() call.
+ */
+extern int payload_tstamp;
+
+/*
+ * Timer overruns.  tx sends frames on an absolute schedule of the
+ * configured rate.  When SIGALRM comes late, the frames it missed go
+ * out at once, up to tx_catchup of them per tick; the rest (all, by
+ * default) are skipped and counted in framegen_dir_stat.deficit, so
+ * the offered load is tx + deficit frames.
+ */
+extern unsigned int tx_catchup;
+
+/*
+ * I/O backend of the slaves: "socket" (default) sends and receives
+ * on the interfaces, "mem" joins the tx and rx of each direction by
+ * an in-memory link instead, to test and benchmark the library
+ * itself without a NIC or root.  The link delays frames by
+ * mem_delay_us and loses and reorders mem_loss_ppm and
+ * mem_reorder_ppm of them (parts per million).  "udp" sends the
+ * payloads as UDP datagrams to the address and port of the header,
+ * over any route and without root.
+ */
+extern char *io_backend;
+extern unsigned int mem_delay_us;
+extern unsigned int mem_loss_ppm;
+extern unsigned int mem_reorder_ppm;
+
+/*
+ * pcap replay: tx sends the frames of tx_pcap (classic pcap,
+ * Ethernet) in turn, over and over, instead of synthetic ones.  They
+ * go at the trial rate, taken in frames of the mean length of the
+ * file, or, if tx_pcap_speed is not 0, at the times of the file
+ * scaled by it (2 - twice as fast) whatever the rate.  Plain IPv4/UDP
+ * frames with room for the test payload get it over the start of
+ * their UDP payload, without the UDP checksum: loss and latency are
+ * counted on these.  The rest go out as captured and are counted in
+ * framegen_health.untagged only.
+ */
+extern char *tx_pcap;
+extern double tx_pcap_speed;
+
+/*
+ * rx capture: the test frames rx accepts also go to a pcap file with
+ * nanosecond timestamps, the first rx_capture_snap bytes of each (0 -
+ * 2048, up to 65535).  %u in the path is the trial number.  With
+ * rx_capture_mb the file is a ring: path.0, path.1, ... of that many
+ * megabytes each, rx_capture_files of them (0 - 2), the oldest
+ * overwritten.  Frames are received straight into the buffers of a
+ * writer thread; when it falls behind, they go uncaptured and are
+ * counted in framegen_health.uncaptured.
+ */
+extern char *rx_capture;
+extern unsigned int rx_capture_snap;
+extern unsigned int rx_capture_mb;
+extern unsigned int rx_capture_files;
+
+/*
+ * Several port pairs in one program: call init_ctrl_handler() once
+ * per pair with a struct framegen_pair as the context.  Each pair
+ * has its own slaves and stats; NULL fields fall back to the
+ * globals above (give each pair its own traces).  Unless CPU lists
+ * are set, each slave gets a CPU of its own.  A NULL context uses
+ * the globals only.  The context names the pair in the framegen_*()
+ * calls, so a second init_ctrl_handler() with the same one (NULL
+ * included) fails.  deinit_ctrl_handler() stops all pairs.
+ */
+
+#define FRAMEGEN_MAX_PAIRS 8
+
+struct framegen_pair {
+	char *tx_ifname;
+	char *rx_ifname;
+	char *tx_trace;
+	char *rx_trace;
+	char *tx_cpus;
+	char *rx_cpus;
+	char *tx_numa;
+	char *rx_numa;
+	int bidirectional;
+	unsigned int rx_drain_us;
+	unsigned int rx_idle_us;
+	int payload_tstamp;
+	unsigned int tx_catchup;
+	char *io_backend;
+	unsigned int mem_delay_us;
+	unsigned int mem_loss_ppm;
+	unsigned int mem_reorder_ppm;
+	char *tx_pcap;
+	double tx_pcap_speed;
+	char *rx_capture;
+	unsigned int rx_capture_snap;
+	unsigned int rx_capture_mb;
+	unsigned int rx_capture_files;
+};
+
+struct framegen_dir_stat {
+	uint32_t tx;		/* frames sent */
+	uint32_t rx;		/* frames received */
+	uint32_t lost;
+	double lat;		/* summed latency, as rx.get_stat */
+	uint64_t drain_ns;	/* rx drain window of the last stop */
+	int64_t lat_min, lat_max;	/* ns, payload_tstamp only */
+	uint64_t deficit;	/* frames the tx schedule skipped */
+};
+
+/*
+ * Stats of both directions of the pair taken at the same moment:
+ * stat[0] - forward (tx_ifname to rx_ifname), stat[1] - reverse,
+ * zeroed unless bidirectional.  context is the one passed to
+ * init_ctrl_handler().  Returns 0 on success
+ */
+int framegen_get_stat(void *context, struct framegen_dir_stat stat[2]);
+
+/*
+ * Health counters of a tx or rx slave, totals of the current or last
+ * trial.  They tell the generator's own trouble from the DUT's.
+ */
+
+/* One per Linux errno up to the last one, EHWPOISON; the last slot
+ * counts larger errnos too */
+#define FRAMEGEN_NERRNO (EHWPOISON + 1)
+
+enum framegen_filter {
+	FRAMEGEN_FILTER_OUTGOING,	/* rx saw our own frame */
+	FRAMEGEN_FILTER_SHORT,
+	FRAMEGEN_FILTER_MAGIC,		/* not a test frame */
+	FRAMEGEN_FILTER_FLOW,		/* a test frame of another flow */
+	FRAMEGEN_FILTER_NR,
+};
+
+struct framegen_health {
+	uint64_t frames;		/* tx: sent, rx: accepted */
+	uint64_t untagged;		/* tx: replayed, no test payload */
+	uint64_t errors[FRAMEGEN_NERRNO]; /* tx: sendmsg() by errno */
+	uint64_t tstamps[3];		/* records by source: user, sw, hw */
+	uint64_t ts_missing;		/* tx: no kernel timestamp in time */
+	uint64_t ts_late;		/* tx: kernel timestamp after that */
+	uint64_t deficit;		/* tx: frames skipped, see tx_catchup */
+	uint64_t catchup;		/* tx: frames sent late in bursts */
+	uint64_t errqueue_bad;		/* tx: no id or timestamp in it,
+					 * mem: the id was not the frame's */
+	uint64_t filtered[FRAMEGEN_FILTER_NR];	/* rx */
+	uint64_t uncaptured;		/* rx: no room in rx_capture */
+	uint64_t snapshots;
+	uint64_t snapshot_ns;		/* time the last one took */
+	uint64_t snapshot_max_ns;
+};
+
+struct framegen_dir_health {
+	struct framegen_health tx, rx;
+};
+
+/*
+ * framegen_get_stat() plus the health counters of the slaves of
+ * each direction, all from the same snapshot
+ */
+int framegen_get_stat_ext(void *context, struct framegen_dir_stat stat[2],
+			  struct framegen_dir_health health[2]);
+
+/*
+ * Inter-departure times: gaps between the tx timestamps of frames
+ * sent one after another, for each timestamp source apart.  hist[k]
+ * counts gaps of 2^k..2^(k+1)-1 ns, the first and the last buckets
+ * also take the shorter and the longer ones.  The deviation is from
+ * the gap of the configured rate, nominal_ns.
+ */
+
+#define FRAMEGEN_IDT_BUCKETS 32
+
+struct framegen_idt {
+	uint64_t gaps;
+	uint64_t hist[FRAMEGEN_IDT_BUCKETS];
+	int64_t min_ns, max_ns;
+	double dev_mean_ns;		/* mean |gap - nominal_ns| */
+	double dev_rms_ns;
+};
+
+struct framegen_dir_idt {
+	uint64_t nominal_ns;
+	struct framegen_idt src[3];	/* user, sw, hw */
+};
+
+/*
+ * Inter-departure times of each direction from the tx records
+ * collected so far: call it after tx.stop for the whole trial.
+ * There are no records, so no gaps, with payload_tstamp
+ */
+int framegen_get_idt(void *context, struct framegen_dir_idt idt[2]);
+
+/*
+ * Scheduled trials.  The next start of the pair arms tx to send the
+ * first frame at start and to stop sending at stop, both absolute
+ * CLOCK_MONOTONIC times (NULL - at once / until stopped).  rx is
+ * counting and tx is armed when the start call returns, so with a
+ * start time a little ahead the trial has no ramp.  tx.stop waits
+ * for the stop time before collecting.  Good for one trial.
+ */
+int framegen_schedule(void *context, const struct timespec *start,
+		       const struct timespec *stop);
+
+/*
+ * Asynchronous control.  framegen_async() posts an operation for
+ * the pair and returns at once; a thread of the library runs it and
+ * makes the eventfd from framegen_async_fd() readable when done (read
+ * it to rearm).  framegen_async_result() then returns 0 and fills in
+ * the operation's result (err) and, for STOP and STAT, the stats; it
+ * returns 1 while the operation runs and -1 if there is none.  One
+ * operation per pair at a time.  framegen_get_stat(), _get_stat_ext(),
+ * _get_idt() and _schedule() on the pair wait for it to finish; the
+ * pair's librfc2544 callbacks must not be used meanwhile.
+ */
+
+enum framegen_op {
+	FRAMEGEN_START,		/* rx then tx, both directions */
+	FRAMEGEN_STOP,		/* tx then rx */
+	FRAMEGEN_STAT,		/* as framegen_get_stat() */
+};
+
+int framegen_async_fd(void *context);
+int framegen_async(void *context, enum framegen_op op);
+int framegen_async_result(void *context, int *err,
+			  struct framegen_dir_stat stat[2]);
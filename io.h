@@ -0,0 +1,145 @@
+/*
+ * Frame I/O backends
+ *
+ * tx.c and rx.c send and receive frames through a struct io_ops,
+ * picked by name (io_backend, see export.h):
+ *
+ *   socket - AF_PACKET socket on the interface, kernel timestamps
+ *   mem    - in-memory link from the tx slave of a direction to its
+ *            rx slave with delay, loss and reorder: no NIC, root or
+ *            kernel in the loop
+ *   udp    - UDP sockets to the address and port of the header, with
+ *            segmentation and GRO offloads: routed paths, no root
+ *
+ * A backend is opened once per slave and started for every trial.
+ * Its calls are made from the same contexts as the socket calls
+ * were: send_batch() from SIGALRM, the rest from the main loop.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+struct slave_ctl;
+
+#define IO_BATCH 32		/* most frames per recv_batch() */
+
+struct io_frame {
+	struct iovec *iov;	/* tx: the frame, rx: where to put it */
+	int iovlen;
+	int len;		/* rx: of the frame, may exceed iov */
+	int outgoing;		/* rx: a frame we sent, looped back */
+	uint32_t id;		/* tx: the id its timestamp is to carry */
+	struct timespec sw, hw;	/* rx: timestamps, zero - none */
+};
+
+/* tx: timestamps of frame id, the id-th sent in this trial */
+struct io_tstamp {
+	uint32_t id;
+	struct timespec sw, hw;
+};
+
+struct io {
+	const struct io_ops *ops;
+	struct slave_ctl *ctl;
+};
+
+struct io_ops {
+	const char *name;
+
+	/* Slave init, tx or rx side.  NULL on error */
+	struct io *(*open)(struct slave_ctl *ctl, int tx);
+	void (*close)(struct io *io);
+
+	/* Trial start: drop what is left from the last one.  tx: ids
+	 * restart at 0, timestamps are reported unless tstamp is 0.
+	 * Returns 1 on error */
+	int (*start)(struct io *io, int tstamp);
+
+	/* tx: the trial is over, send what the backend still holds
+	 * back.  Optional, called from a signal handler */
+	void (*stop)(struct io *io);
+
+	/* tx: send nr frames in order up to the first that fails.
+	 * Returns the number sent, -1 if none; if fewer than nr, errno
+	 * says why the next one failed.  The failed frame is not sent
+	 * again: it may have taken its id (ENOBUFS) */
+	int (*send_batch)(struct io *io, struct io_frame *f, int nr);
+
+	/* rx: receive up to nr frames, waiting at most timeout (NULL -
+	 * up to 100 ms).  Returns the number received or -1 (errno):
+	 * EAGAIN or EINTR if there was nothing */
+	int (*recv_batch)(struct io *io, struct io_frame *f, int nr,
+			  const struct timespec *timeout);
+
+	/* tx: next timestamp.  Returns 1 if there is one, 0 if not yet,
+	 * -1 if the backend got a report it could not make sense of */
+	int (*tstamp)(struct io *io, struct io_tstamp *ts);
+
+	/* tx: will the hardware timestamps come */
+	int (*hw_tstamp)(struct io *io);
+};
+
+extern const struct io_ops io_sock_ops;
+extern const struct io_ops io_mem_ops;
+extern const struct io_ops io_udp_ops;
+
+/* Backend by name, NULL if there is no such one */
+const struct io_ops *io_find(const char *name);
+
+/*
+ * Kernel sockets, shared by the socket and udp backends (io_sock.c)
+ */
+
+//#define ENABLE_TX_SCHED
+
+#ifdef ENABLE_TX_SCHED
+#define TX_SCHED_FLAG SOF_TIMESTAMPING_TX_SCHED
+#else
+#define TX_SCHED_FLAG 0
+#endif
+
+/* Timestamps only (no frame copies), keyed by the send counter */
+#define TX_TSTAMP_FLAGS (SOF_TIMESTAMPING_TX_HARDWARE |		\
+			 TX_SCHED_FLAG |				\
+			 SOF_TIMESTAMPING_TX_SOFTWARE |			\
+			 SOF_TIMESTAMPING_SOFTWARE |			\
+			 SOF_TIMESTAMPING_RAW_HARDWARE |		\
+			 SOF_TIMESTAMPING_OPT_ID |			\
+			 SOF_TIMESTAMPING_OPT_TSONLY)
+
+#define RX_TSTAMP_FLAGS (SOF_TIMESTAMPING_RX_SOFTWARE |		\
+			 /* SOF_TIMESTAMPING_RX_HARDWARE | */		\
+			 SOF_TIMESTAMPING_SOFTWARE |			\
+			 SOF_TIMESTAMPING_RAW_HARDWARE)
+
+struct msghdr;
+
+/* SO_TIMESTAMPING, returns 1 on error */
+int io_set_tstamping(int fd, int val);
+
+/* Throw away timestamps or frames left from the previous trial */
+void io_flush(int fd, int flags);
+
+/* rx: timestamps of a received message into f */
+void io_rx_tstamp(struct msghdr *msg, struct io_frame *f);
+
+/* tx: the error queue of fd, as io_ops.tstamp() */
+int io_read_tstamp(int fd, struct io_tstamp *ts);
+
+/* tx: are NIC timestamps enabled on ifname */
+int io_hw_tstamp(int fd, const char *ifname);
+
+/*
+ * The mem backend's link: a ring in shared memory, mapped by the
+ * master before the slaves of the direction start.  Only the first
+ * MEM_SNAP bytes of a frame are carried, the rest reads as zeros.
+ */
+#define MEM_ORDER 14
+#define MEM_SNAP 128
+
+struct mem_link;
+
+/* NULL on error */
+struct mem_link *mem_link_create(int node);
+void mem_link_destroy(struct mem_link *link);
@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "master.h"
+#include "export.h"
+#include "util.h"
+#include "ipc.h"
+#include "io.h"
+
+/*
+ * In-memory link.  tx writes frames into a single producer/single
+ * consumer ring in shared memory, rx takes them out once their
+ * delivery time has come.  Loss and reorder happen on the tx side,
+ * after the frame got its timestamp, like on a wire: a lost frame is
+ * sent but never received, a reordered one is held back and goes
+ * after the next frame, lost or not, or at the end of the trial.
+ * Timestamps are CLOCK_REALTIME, like the kernel's software ones.
+ * A timestamp of a frame tx sent under another id than the link
+ * counted comes as a bad one (errqueue_bad), so regression runs
+ * catch tx losing step with the ids.
+ */
+
+struct mem_slot {
+	uint64_t due_ns;	/* not to be received before */
+	uint32_t len;		/* of the whole frame */
+	uint8_t data[MEM_SNAP];
+};
+
+struct mem_link {
+	uint32_t size;
+
+	uint32_t head __attribute__((aligned(64)));	/* tx */
+	uint32_t seq;		/* bumped to wake rx */
+
+	uint32_t tail __attribute__((aligned(64)));	/* rx */
+	uint32_t wait;		/* rx is going to sleep */
+
+	struct mem_slot slot[] __attribute__((aligned(64)));
+};
+
+static size_t link_bytes()
+{
+	return sizeof(struct mem_link) +
+		(sizeof(struct mem_slot) << MEM_ORDER);
+}
+
+struct mem_link *mem_link_create(int node)
+{
+	struct mem_link *link;
+
+	link = mmap(NULL, link_bytes(), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (link == MAP_FAILED)
+		return perror("mmap(link)"), NULL;
+
+	if (node >= 0)
+		numa_bind(link, link_bytes(), node);
+
+	link->size = 1 << MEM_ORDER;
+	return link;
+}
+
+void mem_link_destroy(struct mem_link *link)
+{
+	munmap(link, link_bytes());
+}
+
+/* tx timestamps from SIGALRM to the main loop, dropped when full */
+#define TSQ_ORDER 16
+
+/* skew: tx gave the frame another id than the link counted, the
+ * timestamp is reported as one that makes no sense */
+struct mem_tstamp {
+	struct io_tstamp ts;
+	int skew;
+};
+
+struct io_mem {
+	struct io io;
+	struct mem_link *link;
+
+	/* tx: trial settings and state */
+	uint64_t delay_ns;
+	uint32_t loss, reorder;	/* ppm */
+	uint64_t rand;
+	uint32_t id;
+	int tstamp;
+	int held;
+	struct mem_slot hold;
+
+	uint32_t tsq_head, tsq_tail;
+	struct mem_tstamp *tsq;
+};
+
+static inline uint64_t min(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+static uint64_t real_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/* xorshift64*, reproducible for the same flowid */
+static uint32_t mem_ppm(struct io_mem *m)
+{
+	m->rand ^= m->rand >> 12;
+	m->rand ^= m->rand << 25;
+	m->rand ^= m->rand >> 27;
+	return (m->rand * 2685821657736338717ull >> 32) % 1000000;
+}
+
+static struct io *mem_open(struct slave_ctl *ctl, int tx)
+{
+	struct io_mem *m;
+
+	if (!ctl->link) {
+		ERR("no link for the mem backend");
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return perror("calloc"), NULL;
+	m->io.ops = &io_mem_ops;
+	m->io.ctl = ctl;
+	m->link = ctl->link;
+
+	if (tx) {
+		m->tsq = calloc(1 << TSQ_ORDER, sizeof(*m->tsq));
+		if (!m->tsq) {
+			perror("calloc");
+			free(m);
+			return NULL;
+		}
+	}
+
+	return &m->io;
+}
+
+static void mem_close(struct io *io)
+{
+	struct io_mem *m = (struct io_mem *)io;
+
+	free(m->tsq);
+	free(m);
+}
+
+static int mem_start(struct io *io, int tstamp)
+{
+	struct io_mem *m = (struct io_mem *)io;
+	struct slave_ctl *ctl = io->ctl;
+	struct mem_link *link = m->link;
+
+	if (!m->tsq) {
+		/* rx starts first: drop the frames of the last trial */
+		__atomic_store_n(&link->tail,
+				 __atomic_load_n(&link->head, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	m->delay_ns = ctl->link_delay_us * 1000ull;
+	m->loss = ctl->link_loss_ppm;
+	m->reorder = ctl->link_reorder_ppm;
+	m->rand = ctl->flowid * 0x9e3779b97f4a7c15ull | 1;
+	m->id = 0;
+	m->tstamp = tstamp;
+	m->held = 0;
+	m->tsq_head = m->tsq_tail = 0;
+	return 0;
+}
+
+static void mem_copy(struct mem_slot *slot, const struct io_frame *f)
+{
+	uint32_t off = 0, n;
+	int i;
+
+	for (i = 0; i < f->iovlen && off < MEM_SNAP; ++i) {
+		n = min(f->iov[i].iov_len, MEM_SNAP - off);
+		memcpy(slot->data + off, f->iov[i].iov_base, n);
+		off += n;
+	}
+
+	slot->len = 0;
+	for (i = 0; i < f->iovlen; ++i)
+		slot->len += f->iov[i].iov_len;
+}
+
+static int mem_full(struct mem_link *link)
+{
+	return link->head - __atomic_load_n(&link->tail, __ATOMIC_ACQUIRE) ==
+		link->size;
+}
+
+static void mem_put(struct mem_link *link, const struct mem_slot *slot)
+{
+	uint32_t head = link->head;
+
+	link->slot[head & (link->size - 1)] = *slot;
+	/* seq_cst: ordered before the load of wait, see mem_wait() */
+	__atomic_store_n(&link->head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&link->wait, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&link->seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&link->seq);
+	}
+}
+
+/* The held frame goes after the one that overtook it */
+static void mem_release(struct io_mem *m)
+{
+	if (m->held && !mem_full(m->link)) {
+		mem_put(m->link, &m->hold);
+		m->held = 0;
+	}
+}
+
+/*
+ * A full link drops the frame like a full qdisc: it takes its id, as
+ * with OPT_ID, gets ENOBUFS and ends the batch, wherever it is in it.
+ */
+static int mem_send_batch(struct io *io, struct io_frame *f, int nr)
+{
+	struct io_mem *m = (struct io_mem *)io;
+	struct mem_link *link = m->link;
+	struct mem_slot slot;
+	struct mem_tstamp *ts;
+	uint64_t now;
+	int i;
+
+	for (i = 0; i < nr; ++i) {
+		if (mem_full(link)) {
+			m->id++;
+			errno = ENOBUFS;
+			break;
+		}
+
+		now = real_ns();
+		mem_copy(&slot, f + i);
+		slot.due_ns = now + m->delay_ns;
+
+		if (m->loss && mem_ppm(m) < m->loss) {
+			/* lost on the wire, but it did overtake */
+			mem_release(m);
+		} else if (!m->held && m->reorder &&
+			   mem_ppm(m) < m->reorder) {
+			m->hold = slot;
+			m->held = 1;
+		} else {
+			mem_put(link, &slot);
+			mem_release(m);
+		}
+
+		if (m->tstamp && m->tsq_head - m->tsq_tail < 1 << TSQ_ORDER) {
+			ts = m->tsq + (m->tsq_head & ((1 << TSQ_ORDER) - 1));
+			ts->ts.id = m->id;
+			ns_to_ts(now, &ts->ts.sw);
+			memset(&ts->ts.hw, 0, sizeof(ts->ts.hw));
+			ts->skew = f[i].id != m->id;
+			__atomic_store_n(&m->tsq_head, m->tsq_head + 1,
+					 __ATOMIC_RELEASE);
+		}
+		m->id++;
+	}
+
+	return i ? i : -1;
+}
+
+/* No next frame will come to overtake the held one */
+static void mem_stop(struct io *io)
+{
+	mem_release((struct io_mem *)io);
+}
+
+/* SIGALRM fills the queue while the main loop empties it */
+static int mem_tstamp(struct io *io, struct io_tstamp *ts)
+{
+	struct io_mem *m = (struct io_mem *)io;
+	uint32_t tail = m->tsq_tail;
+	struct mem_tstamp *e;
+	int skew;
+
+	if (tail == __atomic_load_n(&m->tsq_head, __ATOMIC_ACQUIRE))
+		return 0;
+
+	e = m->tsq + (tail & ((1 << TSQ_ORDER) - 1));
+	*ts = e->ts;
+	skew = e->skew;
+	__atomic_store_n(&m->tsq_tail, tail + 1, __ATOMIC_RELEASE);
+	return skew ? -1 : 1;
+}
+
+static int mem_hw_tstamp(struct io *io)
+{
+	return 0;
+}
+
+/* Scatter the slot into the frame's buffers, zeros past MEM_SNAP.
+ * Returns the length of the whole frame, as MSG_TRUNC */
+static int mem_take(const struct mem_slot *slot, struct io_frame *f)
+{
+	uint32_t off = 0, n, snap;
+	int i;
+
+	for (i = 0; i < f->iovlen && off < slot->len; ++i) {
+		n = min(f->iov[i].iov_len, slot->len - off);
+		snap = off < MEM_SNAP ? min(n, MEM_SNAP - off) : 0;
+		memcpy(f->iov[i].iov_base, slot->data + off, snap);
+		memset((char *)f->iov[i].iov_base + snap, 0, n - snap);
+		off += n;
+	}
+
+	return slot->len;
+}
+
+/* Sleep until the frame at the tail is due, or a frame comes */
+static void mem_wait(struct mem_link *link, uint32_t tail,
+		     uint64_t due, uint64_t end)
+{
+	struct timespec ts;
+	uint64_t now;
+	uint32_t seq;
+
+	if (tail != __atomic_load_n(&link->head, __ATOMIC_ACQUIRE)) {
+		ns_to_ts(min(due, end), &ts);
+		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
+		return;
+	}
+
+	__atomic_store_n(&link->wait, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&link->seq, __ATOMIC_ACQUIRE);
+	now = real_ns();
+	if (tail == __atomic_load_n(&link->head, __ATOMIC_SEQ_CST) &&
+	    now < end) {
+		ns_to_ts(end - now, &ts);
+		futex_wait(&link->seq, seq, &ts);
+	}
+	__atomic_store_n(&link->wait, 0, __ATOMIC_RELAXED);
+}
+
+static int mem_recv_batch(struct io *io, struct io_frame *f, int nr,
+			  const struct timespec *timeout)
+{
+	struct io_mem *m = (struct io_mem *)io;
+	struct mem_link *link = m->link;
+	uint32_t tail = link->tail, head;
+	struct mem_slot *slot;
+	uint64_t now, end;
+	int i = 0;
+
+	now = real_ns();
+	head = __atomic_load_n(&link->head, __ATOMIC_ACQUIRE);
+	for (; i < nr && tail != head; ++i, ++tail) {
+		slot = link->slot + (tail & (link->size - 1));
+		if (slot->due_ns > now)
+			break;
+
+		f[i].len = mem_take(slot, f + i);
+		f[i].outgoing = 0;
+		ns_to_ts(now, &f[i].sw);
+		memset(&f[i].hw, 0, sizeof(f[i].hw));
+	}
+
+	if (i) {
+		__atomic_store_n(&link->tail, tail, __ATOMIC_RELEASE);
+		return i;
+	}
+
+	/* Nothing yet: wait once, the caller checks its state and
+	 * comes back, as after a socket timeout */
+	end = now + (timeout ? timeout->tv_sec * 1000000000ull +
+		     timeout->tv_nsec : 100 * 1000 * 1000);
+	slot = link->slot + (tail & (link->size - 1));
+	mem_wait(link, tail, tail != head ? slot->due_ns : end, end);
+
+	errno = EAGAIN;
+	return -1;
+}
+
+const struct io_ops io_mem_ops = {
+	.name = "mem",
+	.open = mem_open,
+	.close = mem_close,
+	.start = mem_start,
+	.stop = mem_stop,
+	.send_batch = mem_send_batch,
+	.recv_batch = mem_recv_batch,
+	.tstamp = mem_tstamp,
+	.hw_tstamp = mem_hw_tstamp,
+};
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE /* ppoll, recvmmsg */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netpacket/packet.h>
+#include <net/ethernet.h> /* the L2 protocols */
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+#include "master.h"
+#include "export.h"
+#include "util.h"
+#include "ipc.h"
+#include "io.h"
+
+struct io_sock {
+	struct io io;
+	int fd, tx;
+	struct sockaddr_ll addr;	/* tx: where to */
+
+	/* rx: per frame of a batch */
+	struct mmsghdr msg[IO_BATCH];
+	struct sockaddr_ll from[IO_BATCH];
+	char cmsg[IO_BATCH][256];
+};
+
+int io_set_tstamping(int fd, int val)
+{
+	int err;
+
+	err = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
+	if (err)
+		return perror("setsockopt"), 1;
+
+	return 0;
+}
+
+static struct io *sock_open(struct slave_ctl *ctl, int tx)
+{
+	struct io_sock *s;
+	int err;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return perror("calloc"), NULL;
+	s->io.ops = &io_sock_ops;
+	s->io.ctl = ctl;
+	s->tx = tx;
+
+	s->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (s->fd == -1) {
+		perror("socket");
+		goto err;
+	}
+
+	s->addr.sll_family = AF_PACKET;
+	s->addr.sll_ifindex = if_nametoindex(ctl->ifname);
+
+	if (!s->addr.sll_ifindex) {
+		perror("if_nametoindex");
+		ERR("can't get %s interface index", tx ? "tx" : "rx");
+		goto err;
+	}
+
+	if (tx) {
+		/*
+		 * Should we setsockopt(..., SOL_PACKET, PACKET_QDISC_BYPASS ...) here?
+		 */
+		if (io_set_tstamping(s->fd, TX_TSTAMP_FLAGS))
+			goto err;
+		return &s->io;
+	}
+
+	s->addr.sll_protocol = htons(ETH_P_ALL);
+	err = bind(s->fd, (struct sockaddr *)&s->addr, sizeof(s->addr));
+	if (err) {
+		perror("bind");
+		goto err;
+	}
+
+	if (io_set_tstamping(s->fd, RX_TSTAMP_FLAGS))
+		goto err;
+
+	/* Notice the end of the trial even if no frames arrive */
+	struct timeval tv = { .tv_usec = 100 * 1000 };
+
+	err = setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (err) {
+		perror("setsockopt");
+		goto err;
+	}
+
+	return &s->io;
+
+err:
+	if (s->fd != -1)
+		close(s->fd);
+	free(s);
+	return NULL;
+}
+
+static void sock_close(struct io *io)
+{
+	struct io_sock *s = (struct io_sock *)io;
+
+	close(s->fd);
+	free(s);
+}
+
+void io_flush(int fd, int flags)
+{
+	char buf[1], control[200];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+
+	while (recvmsg(fd, &msg, flags | MSG_DONTWAIT) != -1)
+		msg.msg_controllen = sizeof(control);
+}
+
+static int sock_start(struct io *io, int tstamp)
+{
+	struct io_sock *s = (struct io_sock *)io;
+
+	if (!s->tx) {
+		io_flush(s->fd, 0);
+		return 0;
+	}
+
+	/* Turning OPT_ID on restarts its counter at 0 */
+	if (io_set_tstamping(s->fd, 0) ||
+	    (tstamp && io_set_tstamping(s->fd, TX_TSTAMP_FLAGS)))
+		return 1;
+	io_flush(s->fd, MSG_ERRQUEUE);
+	return 0;
+}
+
+/*
+ * One sendmsg() per frame: a short sendmmsg() loses the errno of the
+ * frame that failed, and a qdisc drop (ENOBUFS) has taken its OPT_ID.
+ * tx has to know both to keep its ids in step with the kernel's.
+ */
+static int sock_send_batch(struct io *io, struct io_frame *f, int nr)
+{
+	struct io_sock *s = (struct io_sock *)io;
+	struct msghdr msg = {
+		.msg_name = &s->addr,
+		.msg_namelen = sizeof(s->addr),
+	};
+	int i;
+
+	for (i = 0; i < nr; ++i) {
+		msg.msg_iov = f[i].iov;
+		msg.msg_iovlen = f[i].iovlen;
+		if (sendmsg(s->fd, &msg, 0) == -1)
+			break;
+	}
+
+	return i ? i : -1;
+}
+
+void io_rx_tstamp(struct msghdr *msg, struct io_frame *f)
+{
+	struct scm_timestamping *tss = NULL;
+	struct cmsghdr *i;
+
+	for_cmsg(i, msg)
+		if (i->cmsg_level == SOL_SOCKET &&
+		    i->cmsg_type == SCM_TIMESTAMPING)
+			tss = (struct scm_timestamping *)CMSG_DATA(i);
+
+	if (!tss) {
+		memset(&f->sw, 0, sizeof(f->sw));
+		memset(&f->hw, 0, sizeof(f->hw));
+		return;
+	}
+
+	f->sw = tss->ts[0];
+	f->hw = tss->ts[2];
+}
+
+static int sock_recv_batch(struct io *io, struct io_frame *f, int nr,
+			   const struct timespec *timeout)
+{
+	struct io_sock *s = (struct io_sock *)io;
+	struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+	int i, flags = MSG_WAITFORONE | MSG_TRUNC;
+
+	if (nr > IO_BATCH)
+		nr = IO_BATCH;
+
+	for (i = 0; i < nr; ++i) {
+		s->msg[i].msg_hdr = (struct msghdr) {
+			.msg_name = s->from + i,
+			.msg_namelen = sizeof(s->from[i]),
+			.msg_iov = f[i].iov,
+			.msg_iovlen = f[i].iovlen,
+			.msg_control = s->cmsg[i],
+			.msg_controllen = sizeof(s->cmsg[i]),
+		};
+	}
+
+	if (timeout) {
+		if (ppoll(&pfd, 1, timeout, NULL) <= 0) {
+			errno = errno == EINTR ? EINTR : EAGAIN;
+			return -1;
+		}
+		flags = MSG_DONTWAIT | MSG_TRUNC;
+	}
+
+	nr = recvmmsg(s->fd, s->msg, nr, flags, NULL);
+	for (i = 0; i < nr; ++i) {
+		f[i].len = s->msg[i].msg_len;
+		f[i].outgoing = s->from[i].sll_pkttype == PACKET_OUTGOING;
+		io_rx_tstamp(&s->msg[i].msg_hdr, f + i);
+	}
+
+	return nr;
+}
+
+int io_read_tstamp(int fd, struct io_tstamp *ts)
+{
+	char control[200];
+	struct cmsghdr *i;
+
+	/* OPT_TSONLY: no frame data, the id is in the error */
+	struct msghdr msg = {
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+
+	int err;
+
+	err = recvmsg(fd, &msg, MSG_ERRQUEUE);
+	if (err == -1) {
+		if (errno == EAGAIN) {
+			/* Spinning keeps latency low, but a real-time
+			 * tx would starve its CPU.  POLLERR is always
+			 * reported and SIGALRM cuts the sleep short */
+			struct pollfd pfd = { .fd = fd };
+
+			if (slave_rt_prio)
+				poll(&pfd, 1, 100);
+			return 0;
+		}
+		perror("recvmsg");
+		ERR("can't recvmsg(ERRQUEUE)");
+		return 0;
+	}
+
+	struct scm_timestamping *tss = 0;
+	struct sock_extended_err *serr = 0;
+
+	for_cmsg(i, &msg) {
+		if (i->cmsg_level == SOL_SOCKET &&
+		    i->cmsg_type == SCM_TIMESTAMPING)
+			tss = (struct scm_timestamping *) CMSG_DATA(i);
+		else if ((i->cmsg_level == SOL_PACKET &&
+			  i->cmsg_type == PACKET_TX_TIMESTAMP) ||
+			 (i->cmsg_level == SOL_IP &&
+			  i->cmsg_type == IP_RECVERR))
+			serr = (struct sock_extended_err *) CMSG_DATA(i);
+	}
+
+	if (!tss || !serr || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+		return -1;
+
+	ts->id = serr->ee_data;
+	ts->sw = tss->ts[0];
+	ts->hw = tss->ts[2];
+	return 1;
+}
+
+static int sock_tstamp(struct io *io, struct io_tstamp *ts)
+{
+	return io_read_tstamp(((struct io_sock *)io)->fd, ts);
+}
+
+/* NIC timestamping is set up by the user, see SIOCSHWTSTAMP */
+int io_hw_tstamp(int fd, const char *ifname)
+{
+	struct hwtstamp_config cfg = {};
+	struct ifreq ifr = {};
+
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_data = (void *)&cfg;
+
+	if (ioctl(fd, SIOCGHWTSTAMP, &ifr))
+		return 0;
+
+	return cfg.tx_type != HWTSTAMP_TX_OFF;
+}
+
+static int sock_hw_tstamp(struct io *io)
+{
+	return io_hw_tstamp(((struct io_sock *)io)->fd, io->ctl->ifname);
+}
+
+const struct io_ops io_sock_ops = {
+	.name = "socket",
+	.open = sock_open,
+	.close = sock_close,
+	.start = sock_start,
+	.send_batch = sock_send_batch,
+	.recv_batch = sock_recv_batch,
+	.tstamp = sock_tstamp,
+	.hw_tstamp = sock_hw_tstamp,
+};
+
+const struct io_ops *io_find(const char *name)
+{
+	static const struct io_ops *ops[] = {
+		&io_sock_ops, &io_mem_ops, &io_udp_ops,
+	};
+	unsigned int i;
+
+	if (!*name)
+		return &io_sock_ops;
+
+	for (i = 0; i < sizeof(ops) / sizeof(*ops); ++i)
+		if (!strcmp(ops[i]->name, name))
+			return ops[i];
+
+	ERR("unknown io backend \"%s\"", name);
+	return NULL;
+}
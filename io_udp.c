@@ -0,0 +1,523 @@
+#define _GNU_SOURCE /* ppoll, recvmmsg */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+
+#include <linux/net_tstamp.h>
+
+#include "master.h"
+#include "export.h"
+#include "util.h"
+#include "ipc.h"
+#include "io.h"
+
+/*
+ * UDP sockets, no root needed.  Only the payload past HEADERS_LEN
+ * goes on the wire: the kernel builds the headers and routes the
+ * datagrams to the address and port of the header, the rest of the
+ * header is ignored.  rx gets the headers back made up from the
+ * datagram's addresses, so the rest of rx sees the usual frames.
+ *
+ * tx hands runs of equal frames to the kernel as one UDP_SEGMENT
+ * call, rx takes what UDP_GRO coalesced apart again.  The OPT_ID of
+ * a call is not per frame, so the call ring maps it back; all the
+ * frames of a call get its timestamp.
+ */
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define UDP_MAX_SEGS 64		/* per UDP_SEGMENT call */
+#define UDP_MAX_PAYLOAD 65507
+#define UDP_FRAME_IOVS 4	/* most iovs of a tx frame */
+
+#define CALL_ORDER 16
+
+struct udp_call {
+	uint32_t id;		/* OPT_ID of the call */
+	uint32_t first;		/* id of its first frame */
+	uint32_t nr;
+};
+
+struct udp_hdrs {
+	struct ethhdr eth;
+	struct iphdr ip;
+	struct udphdr udp;
+} __attribute__((packed));
+
+struct io_udp {
+	struct io io;
+	int fd, tx;
+
+	/* tx */
+	struct sockaddr_in to;
+	int gso;		/* 0 - the kernel refused UDP_SEGMENT */
+	uint32_t calls, frames;	/* this trial */
+	struct udp_call *call;	/* ring, by OPT_ID */
+	struct io_tstamp ts;	/* of the call being reported */
+	uint32_t left;		/* frames of it still to report */
+	struct iovec iov[UDP_MAX_SEGS * UDP_FRAME_IOVS];
+
+	/* rx: a batch of datagrams, taken apart over recv_batch() */
+	uint16_t port;		/* bound to, network order */
+	uint8_t *buf;
+	struct mmsghdr msg[IO_BATCH];
+	struct sockaddr_in from[IO_BATCH];
+	struct iovec rx_iov[IO_BATCH];
+	char cmsg[IO_BATCH][256];
+	int nr, cur;		/* datagrams, the current one */
+	int seg, segs, seg_len;	/* of the current one */
+};
+
+#define UDP_BUF_LEN 65536	/* rx: per datagram */
+
+static struct io *udp_open(struct slave_ctl *ctl, int tx)
+{
+	struct io_udp *u;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return perror("calloc"), NULL;
+	u->io.ops = &io_udp_ops;
+	u->io.ctl = ctl;
+	u->tx = tx;
+	u->fd = -1;
+
+	if (tx) {
+		u->call = calloc(1 << CALL_ORDER, sizeof(*u->call));
+		if (!u->call) {
+			perror("calloc");
+			goto err;
+		}
+
+		u->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (u->fd == -1) {
+			perror("socket");
+			goto err;
+		}
+
+		u->gso = 1;
+		return &u->io;
+	}
+
+	/* The socket is bound to the port of the trial, see udp_bind() */
+	u->buf = malloc(IO_BATCH * UDP_BUF_LEN);
+	if (!u->buf) {
+		perror("malloc");
+		goto err;
+	}
+
+	return &u->io;
+
+err:
+	free(u->call);
+	free(u);
+	return NULL;
+}
+
+static void udp_close(struct io *io)
+{
+	struct io_udp *u = (struct io_udp *)io;
+
+	if (u->fd != -1)
+		close(u->fd);
+	free(u->call);
+	free(u->buf);
+	free(u);
+}
+
+static int udp_bind(struct io_udp *u, uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = port,
+	};
+	struct timeval tv = { .tv_usec = 100 * 1000 };
+	int one = 1, size = 4 << 20;
+
+	if (u->fd != -1)
+		close(u->fd);
+	u->port = 0;
+
+	u->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (u->fd == -1)
+		return perror("socket"), 1;
+
+	if (bind(u->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		ERR("can't bind rx to port %u", ntohs(port));
+		goto err;
+	}
+
+	if (io_set_tstamping(u->fd, RX_TSTAMP_FLAGS))
+		goto err;
+
+	/* Notice the end of the trial even if no frames arrive */
+	if (setsockopt(u->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		perror("setsockopt");
+		goto err;
+	}
+
+	/* Best effort: older kernels have no GRO, the buffer is capped
+	 * by rmem_max */
+	setsockopt(u->fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+	setsockopt(u->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	u->port = port;
+	return 0;
+
+err:
+	close(u->fd);
+	u->fd = -1;
+	return 1;
+}
+
+static int udp_start(struct io *io, int tstamp)
+{
+	struct io_udp *u = (struct io_udp *)io;
+	const header_cfg_t *hdr = &io->ctl->header;
+	int val;
+
+	if (!hdr->udp.dest) {
+		ERR("udp backend: no UDP port in the header");
+		return 1;
+	}
+
+	if (!u->tx) {
+		u->nr = u->cur = 0;
+		if (u->fd == -1 || u->port != hdr->udp.dest)
+			return udp_bind(u, hdr->udp.dest);
+		io_flush(u->fd, 0);
+		return 0;
+	}
+
+	if (!hdr->ip.daddr) {
+		ERR("udp backend: no IP destination in the header");
+		return 1;
+	}
+
+	u->to = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_port = hdr->udp.dest,
+		.sin_addr.s_addr = hdr->ip.daddr,
+	};
+
+	if (hdr->ip.ttl) {
+		val = hdr->ip.ttl;
+		if (setsockopt(u->fd, IPPROTO_IP, IP_TTL, &val, sizeof(val)))
+			return perror("setsockopt(IP_TTL)"), 1;
+	}
+	val = hdr->ip.tos;
+	if (setsockopt(u->fd, IPPROTO_IP, IP_TOS, &val, sizeof(val)))
+		return perror("setsockopt(IP_TOS)"), 1;
+
+	u->calls = u->frames = 0;
+	u->left = 0;
+
+	/* Turning OPT_ID on restarts its counter at 0 */
+	if (io_set_tstamping(u->fd, 0) ||
+	    (tstamp && io_set_tstamping(u->fd, TX_TSTAMP_FLAGS)))
+		return 1;
+	io_flush(u->fd, MSG_ERRQUEUE);
+	return 0;
+}
+
+/* The payload of f: its iovs past HEADERS_LEN.  Returns its length */
+static int udp_payload(const struct io_frame *f, struct iovec *v,
+		       int *nv)
+{
+	size_t skip = HEADERS_LEN, len = 0;
+	int i;
+
+	*nv = 0;
+	for (i = 0; i < f->iovlen; ++i) {
+		if (f->iov[i].iov_len <= skip) {
+			skip -= f->iov[i].iov_len;
+			continue;
+		}
+		v[*nv].iov_base = (char *)f->iov[i].iov_base + skip;
+		v[*nv].iov_len = f->iov[i].iov_len - skip;
+		len += v[(*nv)++].iov_len;
+		skip = 0;
+	}
+
+	return len;
+}
+
+/* Frames f[0..nr-1] as one call, segmented if there are more */
+static int udp_send(struct io_udp *u, const struct io_frame *f, int nr)
+{
+	char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+	struct msghdr msg = {
+		.msg_name = &u->to,
+		.msg_namelen = sizeof(u->to),
+		.msg_iov = u->iov,
+	};
+	struct cmsghdr *cm;
+	int i, nv, len = 0;
+
+	for (i = 0; i < nr; ++i) {
+		len = udp_payload(f + i, u->iov + msg.msg_iovlen, &nv);
+		msg.msg_iovlen += nv;
+	}
+
+	if (nr > 1) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = IPPROTO_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cm) = len;
+	}
+
+	return sendmsg(u->fd, &msg, MSG_DONTWAIT) == -1 ? -1 : 0;
+}
+
+/* How many frames from f go into one call: equal payloads, as long
+ * as they fit into a datagram */
+static int udp_run(struct io_udp *u, const struct io_frame *f, int nr)
+{
+	struct iovec v[UDP_FRAME_IOVS];
+	int i, nv, len, next;
+
+	if (f->iovlen > UDP_FRAME_IOVS)
+		return 0;
+
+	len = udp_payload(f, v, &nv);
+	if (!u->gso || !len)
+		return 1;
+
+	for (i = 1; i < nr && i < UDP_MAX_SEGS; ++i) {
+		if (f[i].iovlen > UDP_FRAME_IOVS)
+			break;
+		next = udp_payload(f + i, v, &nv);
+		if (next != len || (i + 1) * len > UDP_MAX_PAYLOAD)
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * Like the socket backend: a failed first call fails the batch, a
+ * later one ends it.  Without IP_RECVERR the kernel drops a datagram
+ * the qdisc has no room for silently, so there is no ENOBUFS and a
+ * failed call never takes an OPT_ID.
+ */
+static int udp_send_batch(struct io *io, struct io_frame *f, int nr)
+{
+	struct io_udp *u = (struct io_udp *)io;
+	struct udp_call *c;
+	int i, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = udp_run(u, f + i, nr - i);
+		if (!n) {
+			errno = EMSGSIZE;
+			break;
+		}
+
+		if (udp_send(u, f + i, n)) {
+			/* No UDP_SEGMENT there: EIO from the device,
+			 * EINVAL if a segment is over the MTU */
+			if (n > 1 && (errno == EIO || errno == EINVAL)) {
+				u->gso = 0;
+				n = 0;
+				continue;
+			}
+			break;
+		}
+
+		c = u->call + (u->calls & ((1 << CALL_ORDER) - 1));
+		c->id = u->calls++;
+		c->first = u->frames;
+		c->nr = n;
+		u->frames += n;
+	}
+
+	return i ? i : -1;
+}
+
+/* The timestamp of a call once for each of its frames */
+static int udp_tstamp(struct io *io, struct io_tstamp *ts)
+{
+	struct io_udp *u = (struct io_udp *)io;
+	const struct udp_call *c;
+	int err;
+
+	if (!u->left) {
+		err = io_read_tstamp(u->fd, &u->ts);
+		if (err <= 0)
+			return err;
+
+		c = u->call + (u->ts.id & ((1 << CALL_ORDER) - 1));
+		if (c->id != u->ts.id || c->id >= u->calls)
+			return -1;	/* overwritten, or not ours */
+
+		u->ts.id = c->first;
+		u->left = c->nr;
+	}
+
+	*ts = u->ts;
+	u->ts.id++;
+	u->left--;
+	return 1;
+}
+
+static int udp_hw_tstamp(struct io *io)
+{
+	struct io_udp *u = (struct io_udp *)io;
+
+	return io_hw_tstamp(u->fd, io->ctl->ifname);
+}
+
+/* Make the next segment of the current datagram a frame in f */
+static void udp_frame(struct io_udp *u, struct io_frame *f)
+{
+	const header_cfg_t *hdr = &u->io.ctl->header;
+	struct msghdr *msg = &u->msg[u->cur].msg_hdr;
+	const struct sockaddr_in *from = u->from + u->cur;
+	int len = u->msg[u->cur].msg_len - u->seg * u->seg_len;
+	uint8_t *data = u->buf + u->cur * UDP_BUF_LEN + u->seg * u->seg_len;
+	struct udp_hdrs h = { .eth = hdr->eth };
+	size_t off = 0, n;
+	int i;
+
+	if (len > u->seg_len)
+		len = u->seg_len;
+
+	h.ip.version = 4;
+	h.ip.ihl = 5;
+	h.ip.ttl = 64;
+	h.ip.protocol = IPPROTO_UDP;
+	h.ip.tot_len = htons(sizeof(h.ip) + sizeof(h.udp) + len);
+	h.ip.saddr = from->sin_addr.s_addr;
+	h.ip.daddr = hdr->ip.daddr;
+	h.udp.source = from->sin_port;
+	h.udp.dest = u->port;
+	h.udp.len = htons(sizeof(h.udp) + len);
+
+	/* Scatter the headers and the payload over the frame's iovs */
+	for (i = 0; i < f->iovlen && off < HEADERS_LEN + len; ++i) {
+		uint8_t *to = f->iov[i].iov_base;
+		size_t room = f->iov[i].iov_len, c;
+
+		if (off < HEADERS_LEN) {
+			c = HEADERS_LEN - off < room ? HEADERS_LEN - off : room;
+			memcpy(to, (uint8_t *)&h + off, c);
+			off += c;
+			to += c;
+			room -= c;
+			if (!room)
+				continue;
+		}
+		n = HEADERS_LEN + len - off < room ?
+			HEADERS_LEN + len - off : room;
+		memcpy(to, data + off - HEADERS_LEN, n);
+		off += n;
+	}
+
+	f->len = HEADERS_LEN + len;
+	f->outgoing = 0;
+	io_rx_tstamp(msg, f);
+}
+
+/* GRO: the segment size of the datagram, 0 - not coalesced */
+static int udp_gro_size(struct msghdr *msg)
+{
+	struct cmsghdr *i;
+
+	for_cmsg(i, msg)
+		if (i->cmsg_level == IPPROTO_UDP && i->cmsg_type == UDP_GRO)
+			return *(int *)CMSG_DATA(i);
+
+	return 0;
+}
+
+static int udp_recv(struct io_udp *u, const struct timespec *timeout)
+{
+	struct pollfd pfd = { .fd = u->fd, .events = POLLIN };
+	int i, flags = MSG_WAITFORONE;
+
+	for (i = 0; i < IO_BATCH; ++i) {
+		u->rx_iov[i] = (struct iovec) {
+			u->buf + i * UDP_BUF_LEN, UDP_BUF_LEN
+		};
+		u->msg[i].msg_hdr = (struct msghdr) {
+			.msg_name = u->from + i,
+			.msg_namelen = sizeof(u->from[i]),
+			.msg_iov = u->rx_iov + i,
+			.msg_iovlen = 1,
+			.msg_control = u->cmsg[i],
+			.msg_controllen = sizeof(u->cmsg[i]),
+		};
+	}
+
+	if (timeout) {
+		if (ppoll(&pfd, 1, timeout, NULL) <= 0) {
+			errno = errno == EINTR ? EINTR : EAGAIN;
+			return -1;
+		}
+		flags = MSG_DONTWAIT;
+	}
+
+	return recvmmsg(u->fd, u->msg, IO_BATCH, flags, NULL);
+}
+
+static void udp_next(struct io_udp *u)
+{
+	int len = u->msg[u->cur].msg_len;
+
+	u->seg = 0;
+	u->seg_len = udp_gro_size(&u->msg[u->cur].msg_hdr);
+	if (!u->seg_len || u->seg_len > len)
+		u->seg_len = len;
+	/* A zero length datagram is a frame too */
+	u->segs = u->seg_len ? (len + u->seg_len - 1) / u->seg_len : 1;
+}
+
+static int udp_recv_batch(struct io *io, struct io_frame *f, int nr,
+			  const struct timespec *timeout)
+{
+	struct io_udp *u = (struct io_udp *)io;
+	int i, err;
+
+	if (u->cur == u->nr) {
+		err = udp_recv(u, timeout);
+		if (err == -1)
+			return -1;
+		u->nr = err;
+		u->cur = 0;
+		udp_next(u);
+	}
+
+	for (i = 0; i < nr && u->cur < u->nr; ++i) {
+		udp_frame(u, f + i);
+		if (++u->seg == u->segs && ++u->cur < u->nr)
+			udp_next(u);
+	}
+
+	return i;
+}
+
+const struct io_ops io_udp_ops = {
+	.name = "udp",
+	.open = udp_open,
+	.close = udp_close,
+	.start = udp_start,
+	.send_batch = udp_send_batch,
+	.recv_batch = udp_recv_batch,
+	.tstamp = udp_tstamp,
+	.hw_tstamp = udp_hw_tstamp,
+};
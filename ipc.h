@@ -1,46 +1,163 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <limits.h>
+#include <net/if.h>
+
+#include "slave.h"
+
+struct mem_link;
 
 /* SIGSLAVE_STAT - requests slave to send stats
  *
  * SIGSLAVE_STOP - requests slave to send stats for
- * the last time and then stop
+ * the last time in this trial and then go idle.  rx with a drain
+ * window keeps receiving for a while before it does so.
  */
 #define SIGSLAVE_STAT SIGUSR1
 #define SIGSLAVE_STOP SIGUSR2
 
-/* If slave has started rx/tx successfully
- * it sends to master SIGMASTER_OK
+/*
+ * Slaves are spawned once by init_ctrl_handler() and live until
+ * deinit_ctrl_handler(), keeping their sockets between trials.
+ * An idle slave waits for commands in the shared slave_ctl: the
+ * master fills in the trial settings, sets cmd, bumps seq and waits
+ * until the slave copies seq to ack.  Stats within a trial are
+ * still requested with the signals above.
  *
- * If an error occured during slave init
- * it sends to master SIGMASTER_FAIL and then exits
+ * CMD_START is acked only once the slave is ready: rx is counting
+ * and tx has its timer armed.  The master acks all rx slaves before
+ * starting tx, so this is the readiness barrier of a trial.
  */
-#define SIGMASTER_OK SIGUSR1
-#define SIGMASTER_FAIL SIGUSR2
 
-static inline void mask(sigset_t *set)
+enum slave_cmd {
+	CMD_NONE,
+	CMD_START,		/* (re)configure and start a trial */
+	CMD_EXIT,
+};
+
+/* Running latency totals of a trial, updated before each snapshot
+ * is committed.  The only latency stats with payload timestamps */
+struct slave_sum {
+	uint64_t lat_frames;	/* rx: frames with a send time */
+	int64_t lat_ns;		/* rx: summed latency */
+	int64_t lat_min, lat_max;
+};
+
+struct slave_ctl {
+	/* trial settings, valid on CMD_START */
+	header_cfg_t header;
+	ethrate_t rate;
+	unsigned int fsize;
+	unsigned int flowid;
+	char trace[PATH_MAX];	/* empty - no trace */
+	struct timespec start_at; /* CLOCK_MONOTONIC, zero - now */
+	struct timespec stop_at;  /* zero - until SIGSLAVE_STOP */
+	unsigned int drain_us;	/* rx: drain at most that long on stop */
+	unsigned int idle_us;	/* rx: or until no frame for that long */
+	char capture[PATH_MAX];	/* rx: pcap ring, empty - none */
+	unsigned int capture_snap;
+	uint64_t capture_bytes;	/* rx: per file of the ring, 0 - one file */
+	unsigned int capture_files;
+	uint64_t drain_ns;	/* rx: how long the last drain took */
+	int payload_ts;		/* send time in the payload, no records */
+	unsigned int catchup;	/* tx: missed frames to send per tick */
+	uint64_t interval_ns;	/* tx: frame interval of the trial */
+	unsigned int link_delay_us;	/* tx: mem backend link */
+	unsigned int link_loss_ppm;
+	unsigned int link_reorder_ppm;
+	double pcap_speed;	/* tx: replay at the file's times, 0 - rate */
+	struct slave_sum sum;
+	struct framegen_health health;	/* as sum */
+
+	uint32_t cmd;		/* enum slave_cmd */
+	uint32_t seq;		/* bumped by master for every command */
+	uint32_t ack;		/* seq of the last executed command */
+	int err;		/* its result */
+
+	/* placement, set before the slave starts */
+	char ifname[IF_NAMESIZE];
+	char io[16];		/* backend, see io.h, empty - socket */
+	struct mem_link *link;	/* mem backend: of the direction */
+	char pcap[PATH_MAX];	/* tx: file to replay, empty - none */
+	char cpus[256];		/* CPU list, empty - any */
+	int node;		/* NUMA node to run on, -1 - any */
+	int threaded;		/* slave is a thread of the master */
+	uint32_t dead;		/* set by a slave thread on exit */
+};
+
+/* Slave: wait for the next command */
+static inline enum slave_cmd slave_wait_cmd(struct slave_ctl *ctl)
 {
-	int err;
+	uint32_t seq;
 
-	err = sigprocmask(SIG_BLOCK, set, NULL);
-	if (err) {
-		perror("sigprocmask(SIG_BLOCK...)");
-		exit(1);
+	for (;;) {
+		seq = __atomic_load_n(&ctl->seq, __ATOMIC_ACQUIRE);
+		if (seq != ctl->ack)
+			return ctl->cmd;
+		futex_wait(&ctl->seq, seq, NULL);
 	}
 }
 
-static inline void umask(sigset_t *set)
+/* Slave: report result of the current command */
+static inline void slave_ack(struct slave_ctl *ctl, int err)
 {
-	int err;
+	ctl->err = err;
+	__atomic_store_n(&ctl->ack, ctl->seq, __ATOMIC_RELEASE);
+	futex_wake(&ctl->ack);
+}
 
-	err = sigprocmask(SIG_UNBLOCK, set, NULL);
-	if (err) {
-		perror("sigprocmask(SIG_UNBLOCK...)");
-		exit(1);
-	}
+/*
+ * The hot path and the SIGSLAVE_* handlers run in the same thread.
+ * Instead of blocking signals around every push (two syscalls per
+ * frame), the hot path marks itself busy.  A handler that finds it
+ * busy only sets pending, and the hot path takes the snapshot itself
+ * right after the push.
+ */
+
+struct guard {
+	volatile sig_atomic_t busy, pending;
+};
+
+static inline void guard_enter(struct guard *g)
+{
+	g->busy = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Returns 1 if a handler has deferred its work to us */
+static inline int guard_leave(struct guard *g)
+{
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	g->busy = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	if (!g->pending)
+		return 0;
+
+	g->pending = 0;
+	return 1;
 }
 
+/* Called by handler: returns 0 if the work must be deferred */
+static inline int guard_try(struct guard *g)
+{
+	if (!g->busy)
+		return 1;
+
+	g->pending = 1;
+	return 0;
+}
+
+/* Slave: account for a snapshot taken since start (mono_ns()) */
+static inline void health_snapshot(struct framegen_health *h,
+				   uint64_t start)
+{
+	h->snapshot_ns = mono_ns() - start;
+	if (h->snapshot_ns > h->snapshot_max_ns)
+		h->snapshot_max_ns = h->snapshot_ns;
+	h->snapshots++;
+}
 
 /* slave will use these functions to inform
  * master of successful/unsuccessful init
@@ -48,9 +165,11 @@ static inline void umask(sigset_t *set)
 
 static inline void report_fail(int ret)
 {
-	exit(ret);
+	slave_exit(ret);
 }
 
-static inline void report_success()
+/* The master starts with ack != seq and waits for this */
+static inline void report_success(struct slave_ctl *ctl)
 {
+	slave_ack(ctl, 0);
 }
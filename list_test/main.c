@@ -32,20 +32,20 @@ void child(int fd)
 	fl_clear(&head);
 	fl_clear(&head2);
 
-	fl_push(&head, 0, &ts);
-	fl_push(&head, 2, &ts);
-	fl_push(&head, 0, &ts);
-	fl_push(&head, 3, &ts);
-	fl_push(&head, 1, &ts);
-	fl_push(&head, 3, &ts);
+	fl_push(&head, 0, &ts, TS_USER);
+	fl_push(&head, 2, &ts, TS_USER);
+	fl_push(&head, 0, &ts, TS_USER);
+	fl_push(&head, 3, &ts, TS_USER);
+	fl_push(&head, 1, &ts, TS_USER);
+	fl_push(&head, 3, &ts, TS_USER);
 
 	print_list("tx1", &head);
 	fl_send(&head, fd);
 
-	fl_push(&head2, 1, &ts);
-	fl_push(&head2, 0, &ts);
-	fl_push(&head2, 4, &ts);
-	fl_push(&head2, 2, &ts);
+	fl_push(&head2, 1, &ts, TS_USER);
+	fl_push(&head2, 0, &ts, TS_USER);
+	fl_push(&head2, 4, &ts, TS_USER);
+	fl_push(&head2, 2, &ts, TS_USER);
 
 	print_list("tx2", &head2);
 	fl_send(&head2, fd);
@@ -1,180 +1,617 @@
+#define _GNU_SOURCE /* sched_getaffinity */
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
 
 #include <signal.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <math.h>
 
 #include "master.h"
-#include "ipc.h"
+#include "export.h"
 #include "util.h"
+#include "ipc.h"
+#include "ring.h"
+#include "tsc.h"
+#include "probe.h"
+#include "io.h"
+
+/* A slave process or thread and what the master shares with it */
+struct slave {
+	char name[16];
+	int (*main)(struct slave_ctl *ctl, struct ring *out);
+	const char *ifname;
+	const char *trace;	/* path format, see export.h */
+	const char *cpus;
+	const char *numa;
+	const char *io;		/* backend, NULL - socket */
+	struct mem_link *link;	/* mem backend */
+	const char *pcap;	/* tx: tx_pcap */
+	const char *capture;	/* rx: rx_capture, path format */
+	unsigned int cpu_idx;	/* which CPU to take when spreading */
+
+	int pid;		/* process mode */
+	pthread_t thread;	/* threaded mode */
+	int running;
+
+	struct slave_ctl *ctl;
+	struct ring *ring;
+	uint32_t req;		/* snapshot being collected */
+	unsigned int trial;
+};
+
+/*
+ * Asynchronous control: an agent thread per pair runs the blocking
+ * operations and reports completion through an eventfd.  One
+ * operation at a time; its result waits until it is collected.
+ */
+enum agent_state {
+	AGENT_IDLE,
+	AGENT_BUSY,
+	AGENT_DONE,
+};
+
+struct agent {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;			/* eventfd */
+	int exit;
+
+	enum agent_state state;
+	enum framegen_op op;
+	int err;
+	struct framegen_dir_stat stat[2];
+};
+
+/* One direction of a pair, frames go from tx to rx */
+struct dir {
+	struct slave tx, rx;
+	struct fseg rx_stat, tx_stat;	/* by id, one record per id */
+	struct mem_link *link;	/* mem backend, tx to rx */
+};
+
+/* A port pair, one per init_ctrl_handler() */
+struct pair {
+	int used;
+	void *context;
+	int spread;		/* pick a CPU of its own for each slave */
+	int nr_dirs;		/* 2 in bidirectional mode */
+	unsigned int drain_us, idle_us;	/* rx drain window */
+	int payload_ts;		/* stats are the slaves' totals */
+	unsigned int catchup;	/* tx_catchup */
+	const char *io;		/* io_backend */
+	unsigned int link_delay_us, link_loss_ppm, link_reorder_ppm;
+	double pcap_speed;	/* tx_pcap_speed */
+	unsigned int capture_snap, capture_mb, capture_files;
+
+	header_cfg_t header;
+	ethrate_t rate;
+	unsigned int fsize,
+		rx_flowid, tx_flowid;
 
-static header_cfg_t header;
-static ethrate_t rate;
-static unsigned int fsize,
-	rx_flowid, tx_flowid;
+	struct dir dir[2];	/* forward, reverse */
+	struct agent *agent;	/* asynchronous control, on demand */
+	pthread_mutex_t lock;	/* the agent vs framegen_*() calls */
 
-static int tx_pid, rx_pid,
-	tx_pipe, rx_pipe;
+	/* framegen_schedule(), CLOCK_MONOTONIC */
+	struct timespec start_at, stop_at;
+	struct timespec stop_wait;	/* stop of the running trial */
+};
 
-char *whoami = "master";
+static struct pair pairs[FRAMEGEN_MAX_PAIRS];
 
-static struct flist_head rx_stat, tx_stat;
+/* Optional settings, see export.h */
+int bidirectional __attribute__((weak));
+unsigned int rx_drain_us __attribute__((weak));
+unsigned int rx_idle_us __attribute__((weak));
+int payload_tstamp __attribute__((weak));
+unsigned int tx_catchup __attribute__((weak));
+char *io_backend __attribute__((weak));
+unsigned int mem_delay_us __attribute__((weak));
+unsigned int mem_loss_ppm __attribute__((weak));
+unsigned int mem_reorder_ppm __attribute__((weak));
+char *tx_pcap __attribute__((weak));
+double tx_pcap_speed __attribute__((weak));
+char *rx_capture __attribute__((weak));
+unsigned int rx_capture_snap __attribute__((weak));
+unsigned int rx_capture_mb __attribute__((weak));
+unsigned int rx_capture_files __attribute__((weak));
+
+__thread char *whoami = "master";
 
 
 /*
- * Start functions
+ * Slave control
  */
 
-static int tx_start()
+/* Check for slave exit without reaping it */
+static int slave_alive(struct slave *s)
 {
+	siginfo_t info = {};
 	int err;
-	int fd[2], slave_end;
 
-	fl_free(&tx_stat);
+	if (s->ctl->threaded)
+		return !__atomic_load_n(&s->ctl->dead, __ATOMIC_ACQUIRE);
 
-	pipe(fd);
+	err = waitid(P_PID, s->pid, &info, WEXITED | WNOHANG | WNOWAIT);
+	if (err)
+		return 0;
 
-	tx_pipe = fd[0];
-	slave_end = fd[1];
+	return !info.si_pid;
+}
 
-	tx_pid = fork();
-	if (tx_pid == 0) {
-		close(tx_pipe);
-		whoami = "tx";
-		err = tx(&header, rate, fsize, tx_flowid, slave_end);
-		INFO("tx returned %d\n", err);
-		exit(err);
-	} else if (tx_pid > 0) {
-		close(slave_end);
-		return 0;
-	} else {
-		perror("fork");
-		return 1;
+/* kill() for both modes */
+static int slave_kill(struct slave *s, int signum)
+{
+	int err;
+
+	if (!s->ctl->threaded)
+		return kill(s->pid, signum);
+
+	if (!slave_alive(s))
+		return errno = ESRCH, -1;
+
+	err = pthread_kill(s->thread, signum);
+	if (err)
+		return errno = err, -1;
+	return 0;
+}
+
+/* Wait until the slave acks seq, give up if it dies */
+static int slave_wait_ack(struct slave *s, uint32_t seq,
+			  const struct timespec *poll)
+{
+	struct slave_ctl *ctl = s->ctl;
+	uint32_t ack;
+
+	for (;;) {
+		ack = __atomic_load_n(&ctl->ack, __ATOMIC_ACQUIRE);
+		if (ack == seq)
+			return ctl->err;
+
+		if (!slave_alive(s)) {
+			ERR("slave %s died", s->name);
+			return 1;
+		}
+		futex_wait(&ctl->ack, ack, poll);
 	}
 }
 
-static int rx_start()
+/* Pass a command to an idle slave, returns seq to wait for */
+static uint32_t slave_post(struct slave *s, enum slave_cmd cmd)
 {
-	int err;
-	int fd[2], slave_end;
+	struct slave_ctl *ctl = s->ctl;
+	uint32_t seq = ctl->seq + 1;
 
-	fl_free(&rx_stat);
+	ctl->cmd = cmd;
+	__atomic_store_n(&ctl->seq, seq, __ATOMIC_RELEASE);
+	futex_wake(&ctl->seq);
 
-	pipe(fd);
+	return seq;
+}
 
-	rx_pipe = fd[0];
-	slave_end = fd[1];
+/* Execute a command, returns the slave's result */
+static int slave_cmd(struct slave *s, enum slave_cmd cmd)
+{
+	static const struct timespec poll = { .tv_nsec = 10 * 1000 * 1000 };
 
-	rx_pid = fork();
-	if (rx_pid == 0) {
-		close(rx_pipe);
-		whoami = "rx";
-		err = rx(rx_flowid, slave_end);
-		INFO("rx returned %d\n", err);
-		exit(err);
-	} else if (rx_pid > 0) {
-		close(slave_end);
-		return 0;
-	} else {
-		perror("fork");
-		return 1;
+	return slave_wait_ack(s, slave_post(s, cmd), &poll);
+}
+
+/*
+ * Start functions
+ */
+
+/* Trace path for the trial, fmt may contain %u for the trial number.
+ * The reverse direction gets ".rev" appended */
+static void trace_path(const char *fmt, unsigned int trial, int rev,
+		       char path[PATH_MAX])
+{
+	int len;
+
+	if (!fmt) {
+		*path = 0;
+		return;
 	}
+
+	len = snprintf(path, PATH_MAX, fmt, trial);
+	if (rev && len < PATH_MAX)
+		snprintf(path + len, PATH_MAX - len, ".rev");
+}
+
+/* Swap addresses and ports for the reverse direction */
+static void header_reverse(header_cfg_t *hdr)
+{
+	unsigned char mac[ETH_ALEN];
+	uint32_t addr;
+	uint16_t port;
+
+	memcpy(mac, hdr->eth.h_source, ETH_ALEN);
+	memcpy(hdr->eth.h_source, hdr->eth.h_dest, ETH_ALEN);
+	memcpy(hdr->eth.h_dest, mac, ETH_ALEN);
+
+	addr = hdr->ip.saddr;
+	hdr->ip.saddr = hdr->ip.daddr;
+	hdr->ip.daddr = addr;
+
+	port = hdr->udp.source;
+	hdr->udp.source = hdr->udp.dest;
+	hdr->udp.dest = port;
+}
+
+static void tx_setup(struct pair *p, int rev)
+{
+	struct dir *d = p->dir + rev;
+	struct slave_ctl *ctl = d->tx.ctl;
+
+	d->tx_stat.len = 0;
+
+	ctl->header = p->header;
+	ctl->rate = p->rate;
+	ctl->fsize = p->fsize;
+	ctl->flowid = p->tx_flowid;
+	ctl->start_at = p->start_at;
+	ctl->stop_at = p->stop_at;
+	ctl->payload_ts = p->payload_ts;
+	ctl->catchup = p->catchup;
+	ctl->link_delay_us = p->link_delay_us;
+	ctl->link_loss_ppm = p->link_loss_ppm;
+	ctl->link_reorder_ppm = p->link_reorder_ppm;
+	ctl->pcap_speed = p->pcap_speed;
+	if (rev) {
+		header_reverse(&ctl->header);
+		ctl->flowid |= FRAMEGEN_REV_FLOW;
+	}
+	trace_path(d->tx.trace, d->tx.trial++, rev, ctl->trace);
+
+	ring_reset(d->tx.ring);
+}
+
+static void rx_setup(struct pair *p, int rev)
+{
+	struct dir *d = p->dir + rev;
+	struct slave_ctl *ctl = d->rx.ctl;
+
+	d->rx_stat.len = 0;
+
+	ctl->header = p->header;	/* udp: the port to bind */
+	ctl->fsize = p->fsize;		/* for the trace header */
+	ctl->flowid = p->rx_flowid;
+	if (rev) {
+		header_reverse(&ctl->header);
+		ctl->flowid |= FRAMEGEN_REV_FLOW;
+	}
+	trace_path(d->rx.trace, d->rx.trial, rev, ctl->trace);
+	trace_path(d->rx.capture, d->rx.trial++, rev, ctl->capture);
+	ctl->capture_snap = p->capture_snap;
+	ctl->capture_bytes = (uint64_t)p->capture_mb << 20;
+	ctl->capture_files = p->capture_files;
+	ctl->drain_us = p->drain_us;
+	ctl->idle_us = p->idle_us;
+	ctl->payload_ts = p->payload_ts;
+
+	ring_reset(d->rx.ring);
+}
+
+/* Post CMD_START to all slaves first, so directions start together */
+static int start_all(struct slave **s, int nr)
+{
+	static const struct timespec poll = { .tv_nsec = 10 * 1000 * 1000 };
+	uint32_t seq[nr];
+	int i, err = 0;
+
+	PROBE(master_start, s[0]->ctl->flowid, nr);
+	for (i = 0; i < nr; ++i)
+		seq[i] = slave_post(s[i], CMD_START);
+	for (i = 0; i < nr; ++i)
+		err |= slave_wait_ack(s[i], seq[i], &poll);
+
+	PROBE(master_start_done, s[0]->ctl->flowid, err);
+	return err;
+}
+
+static int tx_start(struct pair *p)
+{
+	struct slave *s[2];
+	int i;
+
+	for (i = 0; i < p->nr_dirs; ++i) {
+		tx_setup(p, i);
+		s[i] = &p->dir[i].tx;
+	}
+
+	/* A schedule is good for one trial */
+	p->stop_wait = p->stop_at;
+	memset(&p->start_at, 0, sizeof(p->start_at));
+	memset(&p->stop_at, 0, sizeof(p->stop_at));
+
+	return start_all(s, p->nr_dirs);
+}
+
+static int rx_start(struct pair *p)
+{
+	struct slave *s[2];
+	int i;
+
+	for (i = 0; i < p->nr_dirs; ++i) {
+		rx_setup(p, i);
+		s[i] = &p->dir[i].rx;
+	}
+
+	return start_all(s, p->nr_dirs);
 }
 
 /*
- * Stop functions
+ * Stat transfer
  */
 
-static int slave_stop(int fd, int pid, struct flist_head *head)
+/* Ask slave for a snapshot with signum, -1 if it can't be sent */
+static int slave_request(struct slave *s, int signum)
 {
-	int err;
-	siginfo_t info;
+	s->req = ++s->ring->req;
+	return slave_kill(s, signum);
+}
 
-	err = kill(pid, SIGSLAVE_STOP);
-	if (err)
-		return perror("kill"), 1;
+/*
+ * Collect the requested snapshot from the ring.  The slave writes
+ * while we read, so the ring may be much smaller than the snapshot.
+ * New records go straight to the end of seg, then are merged into
+ * the ones before.
+ */
+static int slave_drain(struct slave *s, struct fseg *seg)
+{
+	static const struct timespec poll = { .tv_nsec = 10 * 1000 * 1000 };
+	struct ring *ring = s->ring;
+	uint32_t old = seg->len;
+	int done;
 
-	err = fl_recv_append(fd, head);
-	if (err)
-		ERR("failed to fl_recv_append");
+	for (;;) {
+		/* records published before done are visible after it */
+		done = ring_done(ring, s->req);
+		if (ring_recv(ring, seg))
+			continue;
+		if (done)
+			break;
 
-	INFO("waiting for %d to terminate", pid);
+		if (!slave_alive(s)) {
+			ERR("slave %s died before sending stat", s->name);
+			PROBE(slave_drain, s->ctl->flowid, seg->len - old, 1);
+			seg->len = old;
+			return 1;
+		}
+		ring_wait(ring, s->req, &poll);
+	}
 
-	err = waitid(P_PID, pid, &info, WEXITED);
-	if (err)
-		return perror("waitid"), 1;
-	INFO("%d terminated with status %d", pid, info.si_status);
+	PROBE(slave_drain, s->ctl->flowid, seg->len - old, 0);
+	fs_merge_tail(seg, old);
+	return 0;
+}
+
+/*
+ * Take snapshots of nr slaves.  All of them are requested before
+ * draining any, so the snapshots are as close in time as possible.
+ * Returns -1 if a signal could not be sent (errno is set).
+ */
+static int collect_all(struct slave **s, struct fseg **heads, int nr,
+		       int signum)
+{
+	int i, err = 0, kill_err = 0, saved;
+	int sent[nr];
+
+	for (i = 0; i < nr; ++i) {
+		sent[i] = !slave_request(s[i], signum);
+		if (!sent[i] && !kill_err) {
+			kill_err = -1;
+			saved = errno;
+		}
+	}
+
+	for (i = 0; i < nr; ++i)
+		if (sent[i])
+			err |= slave_drain(s[i], heads[i]);
 
-	err = close(fd);
+	if (kill_err)
+		errno = saved;
+	return kill_err ?: err;
+}
+
+/*
+ * Stop functions
+ */
+
+/* The slaves send their last stats and go back to waiting for commands */
+static int stop_all(struct slave **s, struct fseg **heads, int nr)
+{
+	int err;
+
+	PROBE(master_stop, s[0]->ctl->flowid, nr);
+	err = collect_all(s, heads, nr, SIGSLAVE_STOP);
+	PROBE(master_stop_done, s[0]->ctl->flowid, err);
 	if (err == -1)
-		return perror("close"), 1;
+		return perror("kill"), 1;
+	if (err) {
+		ERR("failed to collect stat");
+		return 1;
+	}
 
 	return 0;
 }
 
-static int tx_stop()
+static int tx_stop(struct pair *p)
 {
-	return slave_stop(tx_pipe, tx_pid, &tx_stat);
+	struct slave *s[2];
+	struct fseg *heads[2];
+	int i, err;
+
+	/* tx stops sending by itself, let it get there */
+	if (!ts_empty(&p->stop_wait)) {
+		do {
+			err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					      &p->stop_wait, NULL);
+		} while (err == EINTR);
+		memset(&p->stop_wait, 0, sizeof(p->stop_wait));
+	}
+
+	for (i = 0; i < p->nr_dirs; ++i) {
+		s[i] = &p->dir[i].tx;
+		heads[i] = &p->dir[i].tx_stat;
+	}
+
+	return stop_all(s, heads, p->nr_dirs);
 }
 
 
-static int rx_stop()
+static int rx_stop(struct pair *p)
 {
-	return slave_stop(rx_pipe, rx_pid, &rx_stat);
+	struct slave *s[2];
+	struct fseg *heads[2];
+	int i;
+
+	for (i = 0; i < p->nr_dirs; ++i) {
+		s[i] = &p->dir[i].rx;
+		heads[i] = &p->dir[i].rx_stat;
+	}
+
+	return stop_all(s, heads, p->nr_dirs);
 }
 
 /*
  * Statistics functions
  */
 
-static int slave_stat(int fd, int pid, struct flist_head *head)
+static int stat_all(struct slave **s, struct fseg **heads, int nr)
 {
 	int err;
 
-	err = kill(pid, SIGSLAVE_STAT);
-	if (err) {
+	PROBE(master_stat, s[0]->ctl->flowid, nr);
+	err = collect_all(s, heads, nr, SIGSLAVE_STAT);
+	PROBE(master_stat_done, s[0]->ctl->flowid, err);
+	if (err == -1) {
 		if (errno == ESRCH)
 			return 0;
 		perror("kill");
 		return 1;
 	}
 
-	err = fl_recv_append(fd, head);
-	fl_uniq(head);
 	if (err)
-		ERR("fl_recv_append failed to get tx_stat");
+		ERR("failed to collect stat");
 	return err;
 }
 
-static int tx_get_stat(uint32_t *tx)
+static int slave_stat(struct slave *s, struct fseg *head)
+{
+	return stat_all(&s, &head, 1);
+}
+
+/*
+ * Frames sent, from tx's totals: these include the frames still
+ * waiting for a timestamp, which have no record yet
+ */
+static uint32_t dir_sent(struct dir *d)
+{
+	return d->tx.ctl->health.frames;
+}
+
+/* Frames received: from the records or from the totals */
+static uint32_t dir_received(struct pair *p, struct dir *d)
 {
+	if (p->payload_ts)
+		return d->rx.ctl->health.frames;
+	return d->rx_stat.len;
+}
+
+static double dir_latency(struct pair *p, struct dir *d)
+{
+	if (p->payload_ts)
+		return d->rx.ctl->sum.lat_ns * 1e-9;
+	return fs_latency(&d->rx_stat, &d->tx_stat);
+}
+
+/* librfc2544 callbacks report the forward direction */
+static int tx_get_stat(struct pair *p, uint32_t *tx)
+{
+	struct dir *d = p->dir;
 	int err;
 
-	err = slave_stat(tx_pipe, tx_pid, &tx_stat);
+	err = slave_stat(&d->tx, &d->tx_stat);
 	if (err)
 		return err;
 
 	if (tx)
-		*tx = tx_stat.size;
+		*tx = dir_sent(d);
 	return 0;
 }
 
 
-static int rx_get_stat(uint32_t *rx, double *lat)
+static int rx_get_stat(struct pair *p, uint32_t *rx, double *lat)
 {
+	struct dir *d = p->dir;
 	int err;
 
-	err = slave_stat(rx_pipe, rx_pid, &rx_stat);
+	err = slave_stat(&d->rx, &d->rx_stat);
 	if (err)
 		return err;
 
 	if (rx)
-		*rx = rx_stat.size;
+		*rx = dir_received(p, d);
 	if (lat)
-		*lat = fl_latency(&rx_stat, &tx_stat);
+		*lat = dir_latency(p, d);
+	return 0;
+}
+
+/* Per direction results from the records collected so far */
+static void pair_fill_stat(struct pair *p, struct framegen_dir_stat *stat)
+{
+	struct dir *d;
+	int i;
+
+	memset(stat, 0, 2 * sizeof(*stat));
+	for (i = 0; i < p->nr_dirs; ++i) {
+		d = p->dir + i;
+		stat[i].tx = dir_sent(d);
+		stat[i].rx = dir_received(p, d);
+		stat[i].lost = stat[i].tx > stat[i].rx ?
+			stat[i].tx - stat[i].rx : 0;
+		stat[i].lat = dir_latency(p, d);
+		stat[i].drain_ns = d->rx.ctl->drain_ns;
+		stat[i].deficit = d->tx.ctl->health.deficit;
+		if (p->payload_ts) {
+			stat[i].lat_min = d->rx.ctl->sum.lat_min;
+			stat[i].lat_max = d->rx.ctl->sum.lat_max;
+		}
+	}
+}
+
+/* Snapshot of all four slaves of a bidirectional pair */
+static int pair_get_stat(struct pair *p, struct framegen_dir_stat *stat)
+{
+	struct slave *s[4];
+	struct fseg *heads[4];
+	struct dir *d;
+	int i, err;
+
+	for (i = 0; i < p->nr_dirs; ++i) {
+		d = p->dir + i;
+		s[2 * i] = &d->tx;
+		heads[2 * i] = &d->tx_stat;
+		s[2 * i + 1] = &d->rx;
+		heads[2 * i + 1] = &d->rx_stat;
+	}
+
+	err = stat_all(s, heads, 2 * p->nr_dirs);
+	if (err)
+		return err;
+
+	pair_fill_stat(p, stat);
 	return 0;
 }
 
@@ -182,70 +619,813 @@ static int rx_get_stat(uint32_t *rx, double *lat)
  * Configuration functions
  */
 
-static int tx_conf_header(header_cfg_t *hdr)
+static int tx_conf_header(struct pair *p, header_cfg_t *hdr)
 {
-	header = *hdr;
+	p->header = *hdr;
 	return 0;
 }
 
-static int tx_conf_rate(ethrate_t ethrate)
+static int tx_conf_rate(struct pair *p, ethrate_t ethrate)
 {
-	if (ethrate.units == RATE_PERCENT)
+	/* No rate makes no schedule */
+	if (ethrate.units == RATE_PERCENT || !(ethrate.val > 0))
 		return 1;
-	rate = ethrate;
+	p->rate = ethrate;
 	return 0;
 }
 
-static int tx_conf_framesize(unsigned int size)
+static int tx_conf_framesize(struct pair *p, unsigned int size)
 {
-	if (size < sizeof(struct payload) + HEADERS_LEN)
+	if (size < PAYLOAD_LEN(p->payload_ts) + HEADERS_LEN)
 		return 1;
-	fsize = size;
+	p->fsize = size;
 	return 0;
 }
 
-static int tx_conf_flowid(unsigned int fid)
+static int tx_conf_flowid(struct pair *p, unsigned int fid)
 {
-	tx_flowid = fid;
+	p->tx_flowid = fid;
 	return 0;
 }
 
-static int rx_conf_flowid(unsigned int fid)
+static int rx_conf_flowid(struct pair *p, unsigned int fid)
 {
-	rx_flowid = fid;
+	p->rx_flowid = fid;
 	return 0;
 }
 
+/*
+ * librfc2544 callbacks carry no context, so every pair slot gets
+ * its own set of functions that pass the pair on.
+ */
+
+#define PAIR_OPS(n)							\
+static int tx_start_##n()						\
+{ return tx_start(pairs + n); }					\
+static int tx_stop_##n()						\
+{ return tx_stop(pairs + n); }						\
+static int tx_get_stat_##n(uint32_t *tx)				\
+{ return tx_get_stat(pairs + n, tx); }					\
+static int tx_conf_header_##n(header_cfg_t *hdr)			\
+{ return tx_conf_header(pairs + n, hdr); }				\
+static int tx_conf_rate_##n(ethrate_t ethrate)				\
+{ return tx_conf_rate(pairs + n, ethrate); }				\
+static int tx_conf_framesize_##n(unsigned int size)			\
+{ return tx_conf_framesize(pairs + n, size); }				\
+static int tx_conf_flowid_##n(unsigned int fid)			\
+{ return tx_conf_flowid(pairs + n, fid); }				\
+static int rx_start_##n()						\
+{ return rx_start(pairs + n); }					\
+static int rx_stop_##n()						\
+{ return rx_stop(pairs + n); }						\
+static int rx_conf_flowid_##n(unsigned int fid)			\
+{ return rx_conf_flowid(pairs + n, fid); }				\
+static int rx_get_stat_##n(uint32_t *rx, double *lat)			\
+{ return rx_get_stat(pairs + n, rx, lat); }
+
+#define PAIR_HANDLER(n) {						\
+	.tx = {								\
+		.start = tx_start_##n,					\
+		.stop = tx_stop_##n,					\
+		.get_stat = tx_get_stat_##n,				\
+		.conf_header = tx_conf_header_##n,			\
+		.conf_rate = tx_conf_rate_##n,				\
+		.conf_framesize = tx_conf_framesize_##n,		\
+		.conf_flowid = tx_conf_flowid_##n,			\
+	},								\
+	.rx = {								\
+		.start = rx_start_##n,					\
+		.stop = rx_stop_##n,					\
+		.conf_flowid = rx_conf_flowid_##n,			\
+		.get_stat = rx_get_stat_##n,				\
+	}								\
+}
+
+PAIR_OPS(0)
+PAIR_OPS(1)
+PAIR_OPS(2)
+PAIR_OPS(3)
+PAIR_OPS(4)
+PAIR_OPS(5)
+PAIR_OPS(6)
+PAIR_OPS(7)
+
+static const rfc2544_ctrl_handler_t pair_handlers[] = {
+	PAIR_HANDLER(0),
+	PAIR_HANDLER(1),
+	PAIR_HANDLER(2),
+	PAIR_HANDLER(3),
+	PAIR_HANDLER(4),
+	PAIR_HANDLER(5),
+	PAIR_HANDLER(6),
+	PAIR_HANDLER(7),
+};
+
+_Static_assert(sizeof(pair_handlers) / sizeof(*pair_handlers) ==
+	       FRAMEGEN_MAX_PAIRS, "one handler per pair slot");
+
+/*
+ * Slave lifetime
+ */
+
+static struct slave_ctl *ctl_create()
+{
+	struct slave_ctl *ctl;
+
+	ctl = mmap(NULL, sizeof(*ctl), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ctl == MAP_FAILED)
+		return perror("mmap"), NULL;
+
+	/* ack != seq until the slave reports its init */
+	ctl->ack = -1;
+	ctl->threaded = slave_threads;
+	return ctl;
+}
+
+/*
+ * CPUs for the slave: the configured list, else the node's CPUs.
+ * Pairs that came with a context each take CPUs of their own
+ * from that set (or from all allowed CPUs), one per slave.
+ */
+static int slave_cpus(struct slave *s, int node, int spread)
+{
+	char *buf = s->ctl->cpus;
+	size_t len = sizeof(s->ctl->cpus);
+	cpu_set_t set;
+	int i, n;
+
+	if (s->cpus) {
+		snprintf(buf, len, "%s", s->cpus);
+		return 0;
+	}
+
+	if (node >= 0 && !node_cpulist(node, buf, len))
+		*buf = 0;
+
+	if (!spread)
+		return 0;
+
+	if (*buf) {
+		if (cpulist_parse(buf, &set))
+			return 1;
+	} else if (sched_getaffinity(0, sizeof(set), &set)) {
+		return perror("sched_getaffinity"), 1;
+	}
+
+	n = s->cpu_idx % CPU_COUNT(&set);
+	for (i = 0; i < CPU_SETSIZE; ++i)
+		if (CPU_ISSET(i, &set) && !n--)
+			break;
+
+	snprintf(buf, len, "%d", i);
+	return 0;
+}
+
+static void *slave_thread(void *arg)
+{
+	struct slave *s = arg;
+
+	whoami = (char *)s->name;
+	s->main(s->ctl, s->ring);
+	return NULL;
+}
+
+static int slave_fork(struct slave *s)
+{
+	int err;
+
+	s->pid = fork();
+	if (s->pid == -1)
+		return perror("fork"), 1;
+
+	if (s->pid == 0) {
+		whoami = (char *)s->name;
+		/* Do not outlive a crashed master */
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		err = s->main(s->ctl, s->ring);
+		INFO("%s returned %d\n", s->name, err);
+		exit(err);
+	}
+
+	return 0;
+}
+
+static int slave_create_thread(struct slave *s)
+{
+	sigset_t all, old;
+	int err;
+
+	/* Signals of the program must never be delivered to a slave,
+	 * it unblocks its own with slave_sigaction() */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&s->thread, NULL, slave_thread, s);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err)
+		return errno = err, perror("pthread_create"), 1;
+	return 0;
+}
+
+static void slave_reap(struct slave *s)
+{
+	siginfo_t info;
+	int err;
+
+	if (s->ctl->threaded) {
+		pthread_join(s->thread, NULL);
+		return;
+	}
+
+	INFO("waiting for %d to terminate", s->pid);
+
+	err = waitid(P_PID, s->pid, &info, WEXITED);
+	if (err)
+		return perror("waitid");
+	INFO("%d terminated with status %d", s->pid, info.si_status);
+}
+
+static int slave_spawn(struct slave *s, int spread)
+{
+	static const struct timespec poll = { .tv_nsec = 10 * 1000 * 1000 };
+	int node, err;
+
+	node = slave_node(s->ifname, s->numa);
+
+	s->ring = ring_create(RING_ORDER, node);
+	if (!s->ring)
+		return 1;
+
+	s->ctl = ctl_create();
+	if (!s->ctl)
+		return 1;
+
+	snprintf(s->ctl->ifname, sizeof(s->ctl->ifname), "%s", s->ifname);
+	snprintf(s->ctl->io, sizeof(s->ctl->io), "%s", s->io ?: "");
+	s->ctl->link = s->link;
+	snprintf(s->ctl->pcap, sizeof(s->ctl->pcap), "%s", s->pcap ?: "");
+	s->ctl->node = node;
+	if (slave_cpus(s, node, spread))
+		return 1;
+
+	if (s->ctl->threaded)
+		err = slave_create_thread(s);
+	else
+		err = slave_fork(s);
+	if (err)
+		return 1;
+
+	s->running = 1;
+
+	err = slave_wait_ack(s, 0, &poll);
+	if (err) {
+		ERR("%s failed to init", s->name);
+		slave_reap(s);
+		s->running = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void slave_destroy(struct slave *s)
+{
+	if (s->running) {
+		slave_cmd(s, CMD_EXIT);
+		slave_reap(s);
+		s->running = 0;
+	}
+
+	if (s->ctl)
+		munmap(s->ctl, sizeof(*s->ctl));
+	s->ctl = NULL;
+
+	if (s->ring)
+		ring_destroy(s->ring);
+	s->ring = NULL;
+}
+
+/*
+ * Asynchronous control
+ */
+
+static int pair_stop(struct pair *p)
+{
+	int err;
+
+	/* Stop rx even if tx fails, it would run forever otherwise */
+	err = tx_stop(p);
+	err |= rx_stop(p);
+	return err;
+}
+
+static int pair_start(struct pair *p)
+{
+	int err;
+
+	err = rx_start(p);
+	if (!err)
+		err = tx_start(p);
+	if (err) {
+		/* Leave nothing running, slaves that failed to start
+		 * just report their empty stats */
+		memset(&p->stop_wait, 0, sizeof(p->stop_wait));
+		pair_stop(p);
+	}
+	return err;
+}
+
+static void *agent_main(void *arg)
+{
+	struct pair *p = arg;
+	struct agent *a = p->agent;
+	struct framegen_dir_stat stat[2];
+	int err;
+
+	whoami = "agent";
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		while (a->state != AGENT_BUSY && !a->exit)
+			pthread_cond_wait(&a->cond, &a->lock);
+		if (a->exit)
+			break;
+		pthread_mutex_unlock(&a->lock);
+
+		memset(stat, 0, sizeof(stat));
+		pthread_mutex_lock(&p->lock);
+		switch (a->op) {
+		case FRAMEGEN_START:
+			err = pair_start(p);
+			break;
+		case FRAMEGEN_STOP:
+			err = pair_stop(p);
+			pair_fill_stat(p, stat);
+			break;
+		case FRAMEGEN_STAT:
+			err = pair_get_stat(p, stat);
+			break;
+		default:
+			err = 1;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		pthread_mutex_lock(&a->lock);
+		a->err = err;
+		memcpy(a->stat, stat, sizeof(stat));
+		a->state = AGENT_DONE;
+
+		if (eventfd_write(a->fd, 1))
+			perror("eventfd_write");
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+static struct agent *agent_get(struct pair *p)
+{
+	struct agent *a = p->agent;
+	sigset_t all, old;
+	int err;
+
+	if (a)
+		return a;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return perror("calloc"), NULL;
+
+	a->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (a->fd == -1) {
+		perror("eventfd");
+		free(a);
+		return NULL;
+	}
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	p->agent = a;
+
+	/* Signals of the program are not ours to take */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&a->thread, NULL, agent_main, p);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		errno = err;
+		perror("pthread_create");
+		close(a->fd);
+		free(a);
+		p->agent = NULL;
+		return NULL;
+	}
+
+	return a;
+}
+
+static void agent_destroy(struct pair *p)
+{
+	struct agent *a = p->agent;
+
+	if (!a)
+		return;
+
+	/* An operation in progress is finished first */
+	pthread_mutex_lock(&a->lock);
+	a->exit = 1;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+
+	close(a->fd);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->cond);
+	free(a);
+	p->agent = NULL;
+}
+
+static int agent_post(struct pair *p, enum framegen_op op)
+{
+	struct agent *a;
+	int err = 0;
+
+	a = agent_get(p);
+	if (!a)
+		return 1;
+
+	pthread_mutex_lock(&a->lock);
+	if (a->state != AGENT_IDLE) {
+		ERR("%s: previous operation is not collected", p->dir->tx.name);
+		err = 1;
+	} else {
+		a->op = op;
+		a->state = AGENT_BUSY;
+		pthread_cond_signal(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return err;
+}
+
+/*
+ * Pairs
+ */
+
+#define PICK(cfg, field) ((cfg) && (cfg)->field ? (cfg)->field : field)
+
+static void slave_setup(struct slave *s, const char *name,
+			unsigned int idx, int (*main)(struct slave_ctl *,
+						      struct ring *))
+{
+	if (idx == -1)
+		snprintf(s->name, sizeof(s->name), "%s", name);
+	else
+		snprintf(s->name, sizeof(s->name), "%s%u", name, idx);
+
+	s->main = main;
+}
+
+/* Settings come from the context, export.h globals fill the gaps */
+static void pair_setup(struct pair *p, unsigned int idx,
+		       const struct framegen_pair *cfg)
+{
+	struct dir *fwd = p->dir, *rev = p->dir + 1;
+	unsigned int name_idx = cfg ? idx : -1;
+
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, NULL);
+	p->used = 1;
+	p->context = (void *)cfg;
+	p->spread = !!cfg;
+	p->nr_dirs = PICK(cfg, bidirectional) ? 2 : 1;
+	p->drain_us = PICK(cfg, rx_drain_us);
+	p->idle_us = PICK(cfg, rx_idle_us);
+	p->payload_ts = PICK(cfg, payload_tstamp);
+	p->catchup = PICK(cfg, tx_catchup);
+	p->io = PICK(cfg, io_backend);
+	p->link_delay_us = PICK(cfg, mem_delay_us);
+	p->link_loss_ppm = PICK(cfg, mem_loss_ppm);
+	p->link_reorder_ppm = PICK(cfg, mem_reorder_ppm);
+	p->pcap_speed = PICK(cfg, tx_pcap_speed);
+	p->capture_snap = PICK(cfg, rx_capture_snap);
+	p->capture_mb = PICK(cfg, rx_capture_mb);
+	p->capture_files = PICK(cfg, rx_capture_files);
+
+	slave_setup(&fwd->tx, "tx", name_idx, tx);
+	fwd->tx.ifname = PICK(cfg, tx_ifname);
+	fwd->tx.trace = PICK(cfg, tx_trace);
+	fwd->tx.cpus = PICK(cfg, tx_cpus);
+	fwd->tx.numa = PICK(cfg, tx_numa);
+	fwd->tx.pcap = PICK(cfg, tx_pcap);
+
+	slave_setup(&fwd->rx, "rx", name_idx, rx);
+	fwd->rx.ifname = PICK(cfg, rx_ifname);
+	fwd->rx.trace = PICK(cfg, rx_trace);
+	fwd->rx.cpus = PICK(cfg, rx_cpus);
+	fwd->rx.numa = PICK(cfg, rx_numa);
+	fwd->rx.capture = PICK(cfg, rx_capture);
+
+	/* The reverse direction shares the interfaces and their CPUs */
+	slave_setup(&rev->tx, "rtx", name_idx, tx);
+	rev->tx.ifname = fwd->rx.ifname;
+	rev->tx.trace = fwd->tx.trace;
+	rev->tx.cpus = fwd->rx.cpus;
+	rev->tx.numa = fwd->rx.numa;
+	rev->tx.pcap = fwd->tx.pcap;
+
+	slave_setup(&rev->rx, "rrx", name_idx, rx);
+	rev->rx.ifname = fwd->tx.ifname;
+	rev->rx.trace = fwd->rx.trace;
+	rev->rx.cpus = fwd->tx.cpus;
+	rev->rx.numa = fwd->tx.numa;
+	rev->rx.capture = fwd->rx.capture;
+
+	fwd->tx.cpu_idx = 4 * idx;
+	fwd->rx.cpu_idx = 4 * idx + 1;
+	rev->tx.cpu_idx = 4 * idx + 2;
+	rev->rx.cpu_idx = 4 * idx + 3;
+}
+
+static int pair_spawn(struct pair *p)
+{
+	const struct io_ops *ops = io_find(p->io ?: "");
+	struct dir *d;
+	int i;
+
+	if (!ops)
+		return 1;
+
+	for (i = 0; i < p->nr_dirs; ++i) {
+		d = p->dir + i;
+		d->tx.io = d->rx.io = p->io;
+
+		/* Before fork(), as the rings */
+		if (ops == &io_mem_ops) {
+			d->link = mem_link_create(slave_node(d->rx.ifname,
+							     d->rx.numa));
+			if (!d->link)
+				return 1;
+			d->tx.link = d->rx.link = d->link;
+		}
+
+		if (slave_spawn(&d->tx, p->spread) ||
+		    slave_spawn(&d->rx, p->spread))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void pair_destroy(struct pair *p)
+{
+	struct dir *d;
+	int i;
+
+	agent_destroy(p);
+
+	for (i = 0; i < 2; ++i) {
+		d = p->dir + i;
+		slave_destroy(&d->tx);
+		slave_destroy(&d->rx);
+		if (d->link)
+			mem_link_destroy(d->link);
+		d->link = NULL;
+
+		fs_free(&d->tx_stat);
+		fs_free(&d->rx_stat);
+	}
+	pthread_mutex_destroy(&p->lock);
+	p->used = 0;
+}
 
 /*
  * Interface to librfc2544
  *
  */
 
+/* context is NULL or a struct framegen_pair, see export.h */
 int init_ctrl_handler(rfc2544_ctrl_handler_t *handler, void *context)
 {
-	rfc2544_ctrl_handler_t hand = {
-		.tx = {
-			.start = tx_start,
-			.stop = tx_stop,
-			.get_stat = tx_get_stat,
-			.conf_header = tx_conf_header,
-			.conf_rate = tx_conf_rate,
-			.conf_framesize = tx_conf_framesize,
-			.conf_flowid = tx_conf_flowid,
-		},
-		.rx = {
-			.start = rx_start,
-			.stop = rx_stop,
-			.conf_flowid = rx_conf_flowid,
-			.get_stat = rx_get_stat,
+	struct pair *p;
+	int i;
+
+	/* The context is the key of the pair for framegen_*() */
+	for (i = 0; i < FRAMEGEN_MAX_PAIRS; ++i)
+		if (pairs[i].used && pairs[i].context == context) {
+			ERR("context %p already has a port pair", context);
+			return 1;
 		}
-	};
 
-	*handler = hand;
+	for (i = 0; i < FRAMEGEN_MAX_PAIRS && pairs[i].used; ++i)
+		;
+	if (i == FRAMEGEN_MAX_PAIRS) {
+		ERR("too many port pairs, at most %d", FRAMEGEN_MAX_PAIRS);
+		return 1;
+	}
+
+	/* Before fork(): the slaves inherit the calibration */
+	tsc_init();
+
+	p = pairs + i;
+	pair_setup(p, i, context);
+
+	if (pair_spawn(p)) {
+		pair_destroy(p);
+		return 1;
+	}
+
+	*handler = pair_handlers[i];
 	return 0;
 }
 
+/* Stops the slaves of every pair */
 void deinit_ctrl_handler()
 {
+	int i;
+
+	for (i = 0; i < FRAMEGEN_MAX_PAIRS; ++i)
+		if (pairs[i].used)
+			pair_destroy(pairs + i);
+}
+
+static struct pair *pair_find(void *context)
+{
+	int i;
+
+	for (i = 0; i < FRAMEGEN_MAX_PAIRS; ++i)
+		if (pairs[i].used && pairs[i].context == context)
+			return pairs + i;
+
+	ERR("no pair with context %p", context);
+	return NULL;
+}
+
+int framegen_get_stat(void *context, struct framegen_dir_stat stat[2])
+{
+	struct pair *p = pair_find(context);
+	int err;
+
+	if (!p)
+		return 1;
+
+	pthread_mutex_lock(&p->lock);
+	err = pair_get_stat(p, stat);
+	pthread_mutex_unlock(&p->lock);
+	return err;
+}
+
+int framegen_get_stat_ext(void *context, struct framegen_dir_stat stat[2],
+			  struct framegen_dir_health health[2])
+{
+	struct pair *p = pair_find(context);
+	int i, err;
+
+	if (!p)
+		return 1;
+
+	pthread_mutex_lock(&p->lock);
+	err = pair_get_stat(p, stat);
+	if (!err) {
+		/* The slaves copy them in before committing the snapshot */
+		memset(health, 0, 2 * sizeof(*health));
+		for (i = 0; i < p->nr_dirs; ++i) {
+			health[i].tx = p->dir[i].tx.ctl->health;
+			health[i].rx = p->dir[i].rx.ctl->health;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return err;
+}
+
+/* Gaps between the records of consecutive frames with the same source */
+static void dir_idt(struct dir *d, struct framegen_dir_idt *idt)
+{
+	const struct fdata *i, *next, *end = d->tx_stat.rec + d->tx_stat.len;
+	struct framegen_idt *s;
+	int64_t gap, dev;
+	double dev_abs[3] = {}, dev_sq[3] = {};
+	int k;
+
+	memset(idt, 0, sizeof(*idt));
+	idt->nominal_ns = d->tx.ctl->interval_ns;
+
+	for (i = d->tx_stat.rec; i && (next = i + 1) < end; i = next) {
+		if (next->id != i->id + 1 || next->src != i->src)
+			continue;
+
+		s = idt->src + i->src;
+		gap = (next->ts.tv_sec - i->ts.tv_sec) * 1000000000ll +
+			next->ts.tv_nsec - i->ts.tv_nsec;
+
+		k = gap > 0 ? 63 - __builtin_clzll(gap) : 0;
+		s->hist[k < FRAMEGEN_IDT_BUCKETS ?
+			k : FRAMEGEN_IDT_BUCKETS - 1]++;
+
+		if (!s->gaps || gap < s->min_ns)
+			s->min_ns = gap;
+		if (!s->gaps || gap > s->max_ns)
+			s->max_ns = gap;
+		s->gaps++;
+
+		dev = gap - (int64_t)idt->nominal_ns;
+		dev_abs[i->src] += dev < 0 ? -dev : dev;
+		dev_sq[i->src] += (double)dev * dev;
+	}
+
+	for (k = 0; k < 3; ++k) {
+		s = idt->src + k;
+		if (!s->gaps)
+			continue;
+		s->dev_mean_ns = dev_abs[k] / s->gaps;
+		s->dev_rms_ns = sqrt(dev_sq[k] / s->gaps);
+	}
+}
+
+int framegen_get_idt(void *context, struct framegen_dir_idt idt[2])
+{
+	struct pair *p = pair_find(context);
+	int i;
+
+	if (!p)
+		return 1;
+
+	memset(idt, 0, 2 * sizeof(*idt));
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->nr_dirs; ++i)
+		dir_idt(p->dir + i, idt + i);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+int framegen_schedule(void *context, const struct timespec *start,
+		       const struct timespec *stop)
+{
+	struct pair *p = pair_find(context);
+	static const struct timespec zero;
+
+	if (!p)
+		return 1;
+
+	pthread_mutex_lock(&p->lock);
+	p->start_at = start ? *start : zero;
+	p->stop_at = stop ? *stop : zero;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+int framegen_async_fd(void *context)
+{
+	struct pair *p = pair_find(context);
+	struct agent *a;
+
+	if (!p)
+		return -1;
+
+	a = agent_get(p);
+	return a ? a->fd : -1;
+}
+
+int framegen_async(void *context, enum framegen_op op)
+{
+	struct pair *p = pair_find(context);
+
+	if (!p)
+		return 1;
+
+	return agent_post(p, op);
+}
+
+int framegen_async_result(void *context, int *err,
+			  struct framegen_dir_stat stat[2])
+{
+	struct pair *p = pair_find(context);
+	struct agent *a;
+	int ret;
+
+	if (!p || !p->agent)
+		return -1;
+
+	a = p->agent;
+	pthread_mutex_lock(&a->lock);
+	switch (a->state) {
+	case AGENT_DONE:
+		if (err)
+			*err = a->err;
+		if (stat)
+			memcpy(stat, a->stat, sizeof(a->stat));
+		a->state = AGENT_IDLE;
+		ret = 0;
+		break;
+	case AGENT_BUSY:
+		ret = 1;
+		break;
+	default:
+		ret = -1;
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return ret;
 }
@@ -20,17 +20,49 @@ struct payload {
 
 #define MAGIC 0xdeadbeef
 
-struct scm_timestamping {
-	struct timespec ts[3];
-};
+/* Payload with the send time (payload_tstamp, see export.h) */
+struct payload_ts {
+	struct payload hdr;	/* magic is MAGIC_TS */
+	uint64_t tx_ns;		/* CLOCK_REALTIME before sendmsg() */
+} __attribute__((packed));
+
+#define MAGIC_TS 0xdeadbee5
+
+#define PAYLOAD_LEN(ts) \
+	((ts) ? sizeof(struct payload_ts) : sizeof(struct payload))
+
+/* struct scm_timestamping, struct sock_extended_err */
+#include <linux/errqueue.h>
+
+struct ring;
+struct slave_ctl;
+
+/* Slave entry points, never return */
+int tx(struct slave_ctl *ctl, struct ring *out);
+
+int rx(struct slave_ctl *ctl, struct ring *out);
 
-int tx(header_cfg_t *header, ethrate_t ethrate,
-       unsigned int fsize, unsigned int flowid, int out);
+struct iphdr;
 
-int rx(unsigned int flowid, int out);
+void ip_checksum(struct iphdr *ip);
 
 
+static inline uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static inline int ts_empty(struct timespec *ts)
 {
 	return !(ts->tv_sec || ts->tv_nsec);
 }
+
+static inline int ts_before(const struct timespec *a,
+			    const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
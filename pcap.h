@@ -0,0 +1,86 @@
+/*
+ * Classic pcap files (not pcapng), Ethernet only
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+#define LINKTYPE_ETHERNET 1
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;	/* 2 */
+	uint16_t version_minor;	/* 4 */
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* us or ns, by the magic */
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/*
+ * tx replay (tx_pcap, see export.h).  The file is mapped read-only
+ * and indexed once; frames are sent straight from the mapping.
+ */
+
+struct replay_frame {
+	uint64_t ts_ns;		/* since the first frame */
+	size_t off;		/* of the frame in the file */
+	uint32_t len;		/* as captured */
+	uint32_t room;		/* for the payload at HEADERS_LEN, 0 - none */
+};
+
+struct replay {
+	void *map;
+	size_t size;
+	struct replay_frame *frames;
+	uint32_t nr;
+	uint64_t period_ns;	/* of the file: last frame plus the mean gap */
+	uint64_t bytes;		/* captured, of all frames */
+};
+
+/* NULL on error */
+struct replay *replay_open(const char *path);
+void replay_close(struct replay *r);
+
+/*
+ * rx capture (rx_capture, see export.h).  rx receives straight into
+ * the capture buffers, a slot per frame with room for the record
+ * header before it, and commits the frames it accepts.  A thread
+ * writes them out, so rx never waits for the disk; when it falls
+ * behind, frames go uncaptured and are counted.
+ */
+
+#define CAPTURE_MIN_ROOM 128
+
+struct capture;
+struct iovec;
+struct timespec;
+
+/* Records up to snap bytes of a frame.  With file_bytes, files are
+ * path.0, path.1, ... up to files, then the oldest is overwritten.
+ * NULL on error */
+struct capture *capture_open(const char *path, unsigned int snap,
+			     uint64_t file_bytes, unsigned int files);
+
+/* Slots for nr frames at iov[0..nr-1], never blocks.  A slot holds
+ * CAPTURE_MIN_ROOM bytes at least, whatever snap is.  The slots of
+ * the last call that were not committed are reused, so commit in
+ * iov order.  1 if there is no room: the writer is behind */
+int capture_reserve(struct capture *c, struct iovec *iov, int nr);
+
+/* Write the frame received into a slot, len is its full length */
+void capture_commit(struct capture *c, void *data, uint32_t len,
+		    const struct timespec *ts);
+
+/* Write everything committed, stop the writer and close the file */
+void capture_close(struct capture *c);
@@ -0,0 +1,206 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "master.h"
+#include "util.h"
+#include "trace.h"
+
+/*
+ * pcapng export of the binary traces
+ *
+ * Each trace becomes an interface with nanosecond resolution.
+ * Frames are rebuilt from the headers stored in the trace
+ * (tx traces carry them, rx traces borrow them from tx) and
+ * the test payload; the timestamp source goes to the comment.
+ */
+
+#define BT_SHB 0x0a0d0d0a
+#define BT_IDB 0x00000001
+#define BT_EPB 0x00000006
+
+#define OPT_END 0
+#define OPT_COMMENT 1
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+
+#define LINKTYPE_ETHERNET 1
+
+#define PAD4(x) (((x) + 3) & ~3)
+
+static char *src_name[] = {
+	[TS_USER] = "user",
+	[TS_SW] = "sw",
+	[TS_HW] = "hw",
+};
+
+struct block {
+	uint8_t data[256];
+	uint32_t len;
+};
+
+static void put(struct block *b, const void *data, uint32_t len)
+{
+	memcpy(b->data + b->len, data, len);
+	memset(b->data + b->len + len, 0, PAD4(len) - len);
+	b->len += PAD4(len);
+}
+
+static void put32(struct block *b, uint32_t v)
+{
+	put(b, &v, sizeof(v));
+}
+
+static void put_opt(struct block *b, uint16_t code,
+		    const void *data, uint16_t len)
+{
+	uint16_t hdr[2] = { code, len };
+
+	put(b, hdr, sizeof(hdr));
+	if (len)
+		put(b, data, len);
+}
+
+/* Fill in type and both lengths, then write the block */
+static int flush(struct block *b, uint32_t type, FILE *out)
+{
+	uint32_t total = b->len + 12;
+
+	if (fwrite(&type, sizeof(type), 1, out) != 1 ||
+	    fwrite(&total, sizeof(total), 1, out) != 1 ||
+	    fwrite(b->data, b->len, 1, out) != 1 ||
+	    fwrite(&total, sizeof(total), 1, out) != 1)
+		return perror("fwrite"), 1;
+
+	b->len = 0;
+	return 0;
+}
+
+static int write_shb(FILE *out)
+{
+	struct block b = {};
+	uint16_t version[2] = { 1, 0 };
+	int64_t section_len = -1;
+
+	put32(&b, 0x1a2b3c4d);
+	put(&b, version, sizeof(version));
+	put(&b, &section_len, sizeof(section_len));
+	put_opt(&b, OPT_END, NULL, 0);
+
+	return flush(&b, BT_SHB, out);
+}
+
+static int write_idb(const struct trace_hdr *hdr, FILE *out)
+{
+	struct block b = {};
+	uint16_t link[2] = { LINKTYPE_ETHERNET, 0 };
+	uint8_t tsresol = 9;	/* 10^-9 */
+	char name[32];
+
+	snprintf(name, sizeof(name), "%s-flow%u",
+		 hdr->dir == TRACE_TX ? "tx" : "rx", hdr->flowid);
+
+	put(&b, link, sizeof(link));
+	put32(&b, 0);		/* snaplen: unlimited */
+	put_opt(&b, OPT_IF_NAME, name, strlen(name));
+	put_opt(&b, OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+	put_opt(&b, OPT_END, NULL, 0);
+
+	return flush(&b, BT_IDB, out);
+}
+
+static int write_epb(uint32_t ifid, const struct trace_hdr *frame,
+		     const struct trace_rec *rec, FILE *out)
+{
+	struct block b = {};
+	uint8_t data[sizeof(frame->frame) + sizeof(struct payload)];
+	struct payload payload = {
+		.seq = rec->seq,
+		.flowid = rec->flowid,
+		.magic = MAGIC,
+	};
+	uint32_t len = frame->frame_len + sizeof(payload);
+	uint32_t orig = frame->fsize > len ? frame->fsize : len;
+	const char *comment;
+
+	if (rec->src >= sizeof(src_name) / sizeof(*src_name)) {
+		ERR("bad timestamp source %u of frame %u", rec->src, rec->seq);
+		return 1;
+	}
+	comment = src_name[rec->src];
+
+	memcpy(data, frame->frame, frame->frame_len);
+	memcpy(data + frame->frame_len, &payload, sizeof(payload));
+
+	put32(&b, ifid);
+	put32(&b, rec->ts >> 32);
+	put32(&b, rec->ts);
+	put32(&b, len);
+	put32(&b, orig);
+	put(&b, data, len);
+	put_opt(&b, OPT_COMMENT, comment, strlen(comment));
+	put_opt(&b, OPT_END, NULL, 0);
+
+	return flush(&b, BT_EPB, out);
+}
+
+struct cursor {
+	const struct trace_hdr *hdr;
+	const struct trace_rec *rec;
+	size_t nr, pos;
+};
+
+int trace_export_pcapng(const char **paths, int nr, FILE *out)
+{
+	struct cursor cur[nr];
+	const struct trace_hdr *frame = NULL;
+	int i, err = 0;
+
+	memset(cur, 0, sizeof(cur));
+
+	for (i = 0; i < nr; ++i) {
+		cur[i].hdr = trace_map(paths[i], &cur[i].nr);
+		if (!cur[i].hdr) {
+			err = 1;
+			goto unmap;
+		}
+		cur[i].rec = trace_recs(cur[i].hdr);
+		if (!frame && cur[i].hdr->frame_len)
+			frame = cur[i].hdr;
+	}
+
+	err = write_shb(out);
+	for (i = 0; i < nr && !err; ++i)
+		err = write_idb(cur[i].hdr, out);
+
+	/* k-way merge, traces are nearly sorted by time already */
+	while (!err) {
+		struct cursor *min = NULL;
+
+		for (i = 0; i < nr; ++i) {
+			if (cur[i].pos == cur[i].nr)
+				continue;
+			if (!min || cur[i].rec[cur[i].pos].ts <
+			    min->rec[min->pos].ts)
+				min = cur + i;
+		}
+
+		if (!min)
+			break;
+
+		/* each trace has its own headers, rx ones are reversed */
+		err = write_epb(min - cur,
+				min->hdr->frame_len ? min->hdr :
+				frame ?: min->hdr,
+				min->rec + min->pos, out);
+		min->pos++;
+	}
+
+unmap:
+	for (i = 0; i < nr; ++i)
+		if (cur[i].hdr)
+			trace_unmap(cur[i].hdr, cur[i].nr);
+
+	return err;
+}
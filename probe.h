@@ -0,0 +1,31 @@
+/*
+ * USDT probes, provider "framegen", for perf and bpftrace:
+ *
+ *   bpftrace -e 'usdt:./prog:framegen:rx_accept { @[arg4] = count(); }'
+ *
+ * A probe is a nop until attached.  They are built in when
+ * <sys/sdt.h> (systemtap-sdt-dev) is there and -DNO_PROBES is not
+ * given, otherwise they compile to nothing.
+ *
+ *   tx_send(seq, flowid, sec, nsec, ret)   sendmsg() of a frame, user time
+ *   tx_tstamp(seq, flowid, sec, nsec, src) kernel timestamp of a frame
+ *   rx_accept(seq, flowid, sec, nsec, src) test frame of our flow
+ *   rx_reject(seq, flowid, len, reason)    enum framegen_filter
+ *   ring_send(nr), ring_recv(nr)           records to/from the master
+ *   slave_drain(flowid, nr, err)           records of a snapshot taken
+ *   master_{start,stop,stat}(flowid, nr)   the slaves of a call
+ *   master_{start,stop,stat}_done(flowid, err)
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE(name, ...) STAP_PROBEV(framegen, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do {} while (0)
+#endif
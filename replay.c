@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+
+#include "master.h"
+#include "util.h"
+#include "pcap.h"
+
+/*
+ * Room for the test payload: only plain Ethernet, IPv4 without
+ * options and unfragmented UDP are tagged, that is what rx parses.
+ * The UDP checksum is dropped then, so it is left out of the room.
+ */
+static uint32_t frame_room(const uint8_t *data, uint32_t len)
+{
+	const struct ethhdr *eth = (const struct ethhdr *)data;
+	const struct iphdr *ip = (const struct iphdr *)(eth + 1);
+	uint32_t end;
+
+	if (len < HEADERS_LEN ||
+	    eth->h_proto != htons(ETH_P_IP) ||
+	    ip->version != 4 || ip->ihl != 5 ||
+	    ip->protocol != IPPROTO_UDP ||
+	    ip->frag_off & htons(0x3fff))		/* a fragment */
+		return 0;
+
+	end = sizeof(*eth) + ntohs(ip->tot_len);
+	if (end > len)
+		end = len;
+
+	return end > HEADERS_LEN ? end - HEADERS_LEN : 0;
+}
+
+/* Count the frames and check their headers, then index them */
+static int replay_index(struct replay *r, int swap, int ns)
+{
+	const struct pcap_rec_hdr *rec;
+	uint64_t ts, first = 0, last = 0;
+	uint32_t caplen, nr = 0;
+	int pass;
+	size_t off;
+
+	for (pass = 0; pass < 2; ++pass) {
+		off = sizeof(struct pcap_file_hdr);
+		nr = 0;
+
+		while (off + sizeof(*rec) <= r->size) {
+			rec = (const void *)((uint8_t *)r->map + off);
+			caplen = swap ? bswap_32(rec->caplen) : rec->caplen;
+			off += sizeof(*rec);
+
+			if (caplen > r->size - off) {
+				ERR("truncated frame %u", nr);
+				return 1;
+			}
+
+			if (pass) {
+				struct replay_frame *f = r->frames + nr;
+
+				ts = (swap ? bswap_32(rec->ts_sec) : rec->ts_sec) *
+					1000000000ull;
+				ts += (swap ? bswap_32(rec->ts_frac) : rec->ts_frac) *
+					(ns ? 1 : 1000);
+				if (!nr)
+					first = last = ts;
+				if (ts < last)
+					ts = last;	/* merged captures */
+				last = ts;
+
+				f->ts_ns = ts - first;
+				f->off = off;
+				f->len = caplen;
+				f->room = frame_room((uint8_t *)r->map + off, caplen);
+				r->bytes += caplen;
+			}
+
+			off += caplen;
+			++nr;
+		}
+
+		if (!nr) {
+			ERR("no frames");
+			return 1;
+		}
+
+		if (!pass) {
+			r->frames = calloc(nr, sizeof(*r->frames));
+			if (!r->frames)
+				return perror("calloc"), 1;
+		}
+	}
+
+	r->nr = nr;
+	r->period_ns = last - first;
+	if (nr > 1)
+		r->period_ns += (last - first) / (nr - 1);
+
+	return 0;
+}
+
+struct replay *replay_open(const char *path)
+{
+	const struct pcap_file_hdr *hdr;
+	struct replay *r;
+	struct stat st;
+	uint32_t magic, linktype;
+	int fd, swap, ns;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return perror("calloc"), NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		ERR("can't open %s", path);
+		goto err;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		goto err;
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		ERR("%s is not a pcap file", path);
+		close(fd);
+		goto err;
+	}
+
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		perror("mmap");
+		r->map = NULL;
+		goto err;
+	}
+	madvise(r->map, r->size, MADV_WILLNEED);
+
+	hdr = r->map;
+	magic = hdr->magic;
+	swap = magic == bswap_32(PCAP_MAGIC_US) ||
+		magic == bswap_32(PCAP_MAGIC_NS);
+	if (swap)
+		magic = bswap_32(magic);
+	ns = magic == PCAP_MAGIC_NS;
+
+	if (magic != PCAP_MAGIC_US && !ns) {
+		ERR("%s is not a pcap file (pcapng is not supported)", path);
+		goto err;
+	}
+
+	linktype = swap ? bswap_32(hdr->linktype) : hdr->linktype;
+	if (linktype != LINKTYPE_ETHERNET) {
+		ERR("%s: link type %u, only Ethernet is supported",
+		    path, linktype);
+		goto err;
+	}
+
+	if (replay_index(r, swap, ns)) {
+		ERR("bad pcap file %s", path);
+		goto err;
+	}
+
+	return r;
+
+err:
+	replay_close(r);
+	return NULL;
+}
+
+void replay_close(struct replay *r)
+{
+	if (r->map)
+		munmap(r->map, r->size);
+	free(r->frames);
+	free(r);
+}
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <time.h>
+
+#include "util.h"
+#include "ring.h"
+#include "probe.h"
+
+static size_t ring_bytes(unsigned int order)
+{
+	return sizeof(struct ring) + (sizeof(struct fdata) << order);
+}
+
+struct ring *ring_create(unsigned int order, int node)
+{
+	struct ring *ring;
+
+	ring = mmap(NULL, ring_bytes(order), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return perror("mmap(ring)"), NULL;
+
+	/* Before the first touch, the slave writes here most */
+	if (node >= 0)
+		numa_bind(ring, ring_bytes(order), node);
+
+	ring->size = 1 << order;
+	return ring;
+}
+
+void ring_destroy(struct ring *ring)
+{
+	munmap(ring, ring_bytes(__builtin_ctz(ring->size)));
+}
+
+void ring_reset(struct ring *ring)
+{
+	ring->head = ring->tail = 0;
+	ring->done = ring->req = 0;
+	ring->prod_wait = ring->cons_wait = 0;
+}
+
+/*
+ * Sleeping and waking.  The sleeper raises its wait flag, checks the
+ * condition again and sleeps on the other side's seq; the waker
+ * changes the condition, then bumps seq if the flag is up.  The
+ * futex is shared (not FUTEX_PRIVATE) since the ring is.
+ */
+
+static void ring_kick(uint32_t *wait, uint32_t *seq)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(wait, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(wait, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(seq);
+}
+
+static uint32_t ring_prepare(uint32_t *wait, uint32_t *seq)
+{
+	uint32_t val = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+
+	__atomic_store_n(wait, 1, __ATOMIC_SEQ_CST);
+	return val;
+}
+
+static inline int ring_full(struct ring *ring)
+{
+	return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+		ring->size;
+}
+
+static void ring_publish(struct ring *ring, uint32_t pos)
+{
+	if (pos == ring->head)
+		return;
+
+	__atomic_store_n(&ring->head, pos, __ATOMIC_RELEASE);
+	ring_kick(&ring->cons_wait, &ring->prod_seq);
+}
+
+/* Records go out in runs: head and the wakeup once per run, not per
+ * record.  A run ends when the ring is full */
+void ring_send(const struct fdata *rec, uint32_t nr, struct ring *ring)
+{
+	uint32_t pos = ring->head;
+	uint32_t i;
+
+	PROBE(ring_send, nr);
+	for (i = 0; i < nr; ++i) {
+		if (pos - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+		    ring->size) {
+			ring_publish(ring, pos);
+			while (ring_full(ring)) {
+				uint32_t val;
+
+				val = ring_prepare(&ring->prod_wait,
+						   &ring->cons_seq);
+				if (ring_full(ring))
+					futex_wait(&ring->cons_seq, val, NULL);
+			}
+		}
+
+		ring->rec[pos & (ring->size - 1)] = rec[i];
+		++pos;
+	}
+	ring_publish(ring, pos);
+}
+
+void ring_commit(struct ring *ring)
+{
+	__atomic_store_n(&ring->done, ring->done + 1, __ATOMIC_RELEASE);
+	ring_kick(&ring->cons_wait, &ring->prod_seq);
+}
+
+int ring_recv(struct ring *ring, struct fseg *seg)
+{
+	uint32_t tail = ring->tail;
+	uint32_t end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t nr = end - tail, pos, run;
+
+	if (!nr)
+		return 0;
+
+	PROBE(ring_recv, nr);
+	fs_reserve(seg, nr);
+
+	/* At most two runs: up to the end of the ring, then from its start */
+	pos = tail & (ring->size - 1);
+	run = ring->size - pos < nr ? ring->size - pos : nr;
+	memcpy(seg->rec + seg->len, ring->rec + pos, run * sizeof(*seg->rec));
+	memcpy(seg->rec + seg->len + run, ring->rec,
+	       (nr - run) * sizeof(*seg->rec));
+	seg->len += nr;
+
+	__atomic_store_n(&ring->tail, end, __ATOMIC_RELEASE);
+	ring_kick(&ring->prod_wait, &ring->cons_seq);
+	return nr;
+}
+
+void ring_wait(struct ring *ring, uint32_t req,
+	       const struct timespec *timeout)
+{
+	uint32_t val;
+
+	val = ring_prepare(&ring->cons_wait, &ring->prod_seq);
+	if (ring_done(ring, req) ||
+	    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+		return;
+
+	futex_wait(&ring->prod_seq, val, timeout);
+}
@@ -0,0 +1,66 @@
+/*
+ * Single producer/single consumer ring in shared memory
+ *
+ * The master maps one ring per slave before fork().  The slave
+ * publishes its records into the ring, the master drains them
+ * into its own array while the slave is still writing.  Snapshots
+ * are counted, so the master knows when the slave is done.
+ *
+ * Either side sleeps on a futex only when the ring is full/empty.
+ */
+
+#include <stdint.h>
+
+struct ring {
+	uint32_t size;			/* power of 2 */
+
+	/* written by producer */
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t done;			/* snapshots published */
+	uint32_t prod_seq;		/* bumped to wake consumer */
+
+	/* written by consumer */
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t req;			/* snapshots requested */
+	uint32_t cons_seq;		/* bumped to wake producer */
+
+	/* set by the side that is going to sleep */
+	uint32_t prod_wait __attribute__((aligned(64)));
+	uint32_t cons_wait;
+
+	struct fdata rec[] __attribute__((aligned(64)));
+};
+
+#define RING_ORDER 16
+
+struct fseg;
+struct timespec;
+
+/* Map shared ring of 2^order records on NUMA node (-1 - any),
+ * NULL on error */
+struct ring *ring_create(unsigned int order, int node);
+
+void ring_destroy(struct ring *ring);
+
+/* Empty the ring, nobody may use it meanwhile */
+void ring_reset(struct ring *ring);
+
+/* Producer: publish records, sleeps while the ring is full */
+void ring_send(const struct fdata *rec, uint32_t nr, struct ring *ring);
+
+/* Producer: mark the end of the snapshot */
+void ring_commit(struct ring *ring);
+
+/* Consumer: move available records to the end of the segment,
+ * returns number of records moved */
+int ring_recv(struct ring *ring, struct fseg *seg);
+
+/* Consumer: has the producer published snapshot req */
+static inline int ring_done(struct ring *ring, uint32_t req)
+{
+	return __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) == req;
+}
+
+/* Consumer: sleep until there are records or snapshot req is done */
+void ring_wait(struct ring *ring, uint32_t req,
+	       const struct timespec *timeout);
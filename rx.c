@@ -1,73 +1,87 @@
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <netpacket/packet.h>
-#include <net/ethernet.h> /* the L2 protocols */
-#include <net/if.h>
-
-#include <linux/net_tstamp.h>
+#include <net/ethernet.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
-#include <assert.h>
 
 #include <time.h>
 
 #include "master.h"
 #include "export.h"
-#include "ipc.h"
 #include "util.h"
+#include "ipc.h"
+#include "trace.h"
+#include "ring.h"
+#include "tsc.h"
+#include "probe.h"
+#include "io.h"
+#include "pcap.h"
+
+static SLAVE_LOCAL struct slave_ctl *ctl;
+static SLAVE_LOCAL struct ring *master_ring;
+static SLAVE_LOCAL unsigned int flowid;
+static SLAVE_LOCAL volatile sig_atomic_t running;
+
+/* Drain window, see drain_wait() */
+static SLAVE_LOCAL volatile sig_atomic_t draining;
+static SLAVE_LOCAL uint64_t drain_start, last_frame;
+
+static SLAVE_LOCAL struct fseg stat;
+static SLAVE_LOCAL struct slave_sum sum;
+static SLAVE_LOCAL struct framegen_health health;	/* main loop only */
+static SLAVE_LOCAL int payload_ts;	/* send no records, totals only */
+static SLAVE_LOCAL struct guard guard;
+static SLAVE_LOCAL volatile sig_atomic_t stopping;
+static SLAVE_LOCAL struct trace *trace;
+static SLAVE_LOCAL struct capture *capture;
 
-static int master_pipe;
-static unsigned int flowid;
+/*
+ * Frame buffers
+ */
 
-static struct flist_head stat;
+static SLAVE_LOCAL struct io *io;
 
 /*
- * Socket initialization
+ * Only the start of a frame is read.  Packed: it is also the start
+ * of a whole frame received into a capture slot.
  */
+struct rx_buf {
+	struct ethhdr eth;
+	struct iphdr ip;
+	struct udphdr udp;
+	struct payload_ts payload;
+} __attribute__((packed));
 
-static int sockfd;
+static SLAVE_LOCAL struct rx_buf *bufs;
+static SLAVE_LOCAL struct iovec *iovs;		/* into bufs */
+static SLAVE_LOCAL struct iovec *cap_iovs;	/* into capture slots */
+static SLAVE_LOCAL struct io_frame *frames;
 
-static void setup_sock()
+static void setup_io()
 {
-	int err;
-
-	sockfd = socket(AF_PACKET, SOCK_RAW, 0);
-	if (sockfd == -1) {
-		perror("socket");
+	const struct io_ops *ops = io_find(ctl->io);
+	int k;
+
+	bufs = calloc(IO_BATCH, sizeof(*bufs));
+	iovs = calloc(IO_BATCH, sizeof(*iovs));
+	cap_iovs = calloc(IO_BATCH, sizeof(*cap_iovs));
+	frames = calloc(IO_BATCH, sizeof(*frames));
+	if (!bufs || !iovs || !cap_iovs || !frames) {
+		perror("calloc");
 		report_fail(1);
 	}
 
-	struct sockaddr_ll addr = {
-		.sll_family = AF_PACKET,
-		.sll_ifindex  = if_nametoindex(rx_ifname),
-		.sll_protocol = htons(ETH_P_ALL),
-	};
-
-	if (!addr.sll_ifindex) {
-		perror("if_nametoindex");
-		ERR("can't get rx interface index");
-		exit(1);
-	}
-
-	err = bind(sockfd, (struct sockaddr *) &addr, sizeof(addr));
-	if (err) {
-		perror("bind");
-		report_fail(1);
+	for (k = 0; k < IO_BATCH; ++k) {
+		iovs[k] = (struct iovec) { bufs + k, sizeof(*bufs) };
+		frames[k].iovlen = 1;
 	}
 
-	int val = SOF_TIMESTAMPING_RX_SOFTWARE |
-		/* SOF_TIMESTAMPING_RX_HARDWARE | */
-		SOF_TIMESTAMPING_SOFTWARE |
-		SOF_TIMESTAMPING_RAW_HARDWARE;
-
-	err = setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
-	if (err) {
-		perror("setsockopt");
+	io = ops ? ops->open(ctl, 0) : NULL;
+	if (!io)
 		report_fail(1);
-	}
 }
 
 
@@ -78,153 +92,354 @@ static void setup_sock()
 
 static void handle(int signum);
 
-static sigset_t signals;
-
 static void setup_signals()
 {
-	int err;
-	struct sigaction act = {
-		.sa_mask = signals
-	};
+	if (slave_sigaction(SIGSLAVE_STAT, handle) ||
+	    slave_sigaction(SIGSLAVE_STOP, handle))
+		report_fail(1);
+}
 
-	sigemptyset(&signals);
-	sigaddset(&signals, SIGSLAVE_STAT);
-	sigaddset(&signals, SIGSLAVE_STOP);
+/*
+ * Signal handler
+ */
 
-	act.sa_handler = handle;
-	err = sigaction(SIGSLAVE_STAT, &act, NULL);
-	if (err) {
-		perror("sigaction");
-		report_fail(1);
+static void send_stats()
+{
+	uint64_t start = mono_ns();
+
+	if (trace)
+		trace_array(trace, stat.rec, stat.len, flowid);
+
+	if (!payload_ts)
+		ring_send(stat.rec, stat.len, master_ring);
+	ctl->sum = sum;
+	health_snapshot(&health, start);
+	ctl->health = health;
+	ring_commit(master_ring);
+	stat.len = 0;
+
+	if (stopping) {
+		running = 0;
+		stopping = 0;
 	}
+}
 
-	err = sigaction(SIGSLAVE_STOP, &act, NULL);
-	if (err) {
-		perror("sigaction");
-		report_fail(1);
+void handle(int signum)
+{
+	/* Frames may still be in flight: stop later, in drain_wait() */
+	if (signum == SIGSLAVE_STOP && running && !draining &&
+	    (ctl->drain_us || ctl->idle_us)) {
+		drain_start = last_frame = mono_ns();
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		draining = 1;
+		return;
 	}
+
+	if (signum == SIGSLAVE_STOP)
+		stopping = 1;
+
+	if (guard_try(&guard))
+		send_stats();
 }
 
 /*
- * Signal handler
+ * Keep receiving after SIGSLAVE_STOP until drain_us has passed since
+ * the stop or no test frame has come for idle_us, whichever is first.
+ * Returns 1 at the end, else the time left to wait for a frame.
  */
-
-void handle(int signum)
+static int drain_wait(struct timespec *left)
 {
-	int err;
+	uint64_t now, end = -1;
 
-	err = fl_send(&stat, master_pipe);
-	if (err) {
-		ERR("failed to send stat");
-		exit(1);
-	}
+	if (ctl->drain_us)
+		end = drain_start + ctl->drain_us * 1000ull;
+	if (ctl->idle_us && last_frame + ctl->idle_us * 1000ull < end)
+		end = last_frame + ctl->idle_us * 1000ull;
 
-	fl_free(&stat);
+	now = mono_ns();
+	if (now >= end)
+		return 1;
 
-	if (signum == SIGSLAVE_STOP)
-		exit(0);
+	left->tv_sec = (end - now) / 1000000000;
+	left->tv_nsec = (end - now) % 1000000000;
+	return 0;
 }
 
+static void drain_finish()
+{
+	ctl->drain_ns = mono_ns() - drain_start;
+	draining = 0;
+
+	guard_enter(&guard);
+	stopping = 1;
+	send_stats();
+	if (guard_leave(&guard))
+		send_stats();
+}
 
-static void recv_pkt()
+static int setup_trace(const char *path)
 {
-	int err;
-	int len;
-	struct ethhdr eth;
-	struct iphdr ip;
-	struct udphdr udp;
-	struct payload payload;
-	struct sockaddr_ll addr;
-	struct timespec ts;
-	struct cmsghdr *i;
-	char cmsg[1000];
-
-	struct iovec iov[] = {
-		{
-			.iov_base = &eth,
-			.iov_len  = sizeof(eth)
-		}, {
-			.iov_base = &ip,
-			.iov_len  = sizeof(ip)
-		}, {
-			.iov_base = &udp,
-			.iov_len  = sizeof(udp)
-		}, {
-			.iov_base = &payload,
-			.iov_len  = sizeof(payload)
-		}
+	struct trace_hdr hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.dir = TRACE_RX,
+		.flowid = flowid,
+		.fsize = ctl->fsize,
+		.frame_len = HEADERS_LEN,
 	};
+	header_cfg_t h = ctl->header;	/* reversed for the back flow */
+	int udp_len = ctl->fsize - sizeof(h.eth) - sizeof(h.ip);
 
-	struct msghdr msg = {
-		.msg_name = &addr,
-		.msg_namelen = sizeof(addr),
-		.msg_iov = iov,
-		.msg_iovlen = sizeof(iov)/sizeof(*iov),
-		.msg_control = cmsg,
-		.msg_controllen = sizeof(cmsg)
-	};
+	if (!*path)
+		return 0;
 
-again:
+	h.ip.tot_len = htons(udp_len + sizeof(h.ip));
+	h.udp.len = htons(udp_len);
+	ip_checksum(&h.ip);
 
-	len = recvmsg(sockfd, &msg, 0);
-	if (len == -1) {
-		if (errno == EINTR)
-			goto again;
-		perror("recvmsg");
-		exit(1);
-	}
-	err = clock_gettime(CLOCK_REALTIME, &ts);
-	if (err == -1) {
-		perror("clock_gettime");
-		exit(1);
-	}
+	memcpy(hdr.frame, &h.eth, sizeof(h.eth));
+	memcpy(hdr.frame + sizeof(h.eth), &h.ip, sizeof(h.ip));
+	memcpy(hdr.frame + sizeof(h.eth) + sizeof(h.ip), &h.udp,
+	       sizeof(h.udp));
+
+	trace = trace_open(path, &hdr);
+	if (!trace)
+		return 1;
+
+	return 0;
+}
 
-	if (addr.sll_pkttype == PACKET_OUTGOING)
-		goto again;
 
-	if (len < HEADERS_LEN + sizeof(payload))
-		goto again;
+/*
+ * The send time is CLOCK_REALTIME of the sender, so it is compared
+ * with the software timestamp, never with the NIC's clock.
+ */
+static void add_latency(const struct timespec *ts, uint64_t tx_ns)
+{
+	int64_t lat = ts->tv_sec * 1000000000ll + ts->tv_nsec - tx_ns;
+
+	if (!sum.lat_frames || lat < sum.lat_min)
+		sum.lat_min = lat;
+	if (!sum.lat_frames || lat > sum.lat_max)
+		sum.lat_max = lat;
+	sum.lat_ns += lat;
+	sum.lat_frames++;
+}
 
-	if (payload.magic != MAGIC)
-		goto again;
+/* Returns 1 if the frame is accepted, its record time goes to when */
+static int recv_pkt(struct io_frame *f, struct rx_buf *b,
+		    struct timespec *when)
+{
+	enum framegen_filter reason;
+	struct payload_ts *payload = &b->payload;
+	struct timespec ts, *soft = &f->sw, *hard = &f->hw, *result;
+	enum ts_src src;
+
+	if (f->outgoing) {
+		reason = FRAMEGEN_FILTER_OUTGOING;
+		goto reject;
+	}
 
-	if (payload.flowid != flowid)
-		goto again;
+	if (f->len < HEADERS_LEN + sizeof(payload->hdr)) {
+		reason = FRAMEGEN_FILTER_SHORT;
+		goto reject;
+	}
 
-	struct scm_timestamping *tss = 0;
-	struct timespec *soft, *hard, *result;
+	if (payload->hdr.magic == MAGIC_TS) {
+		if (f->len < HEADERS_LEN + sizeof(*payload)) {
+			reason = FRAMEGEN_FILTER_SHORT;
+			goto reject;
+		}
+	} else if (payload->hdr.magic != MAGIC) {
+		reason = FRAMEGEN_FILTER_MAGIC;
+		goto reject;
+	}
 
-	for_cmsg(i, &msg)
-		if (i->cmsg_level == SOL_SOCKET &&
-		    i->cmsg_type == SCM_TIMESTAMPING)
-			tss = (struct scm_timestamping *) CMSG_DATA(i);
+	if (payload->hdr.flowid != flowid) {
+		reason = FRAMEGEN_FILTER_FLOW;
+		goto reject;
+	}
 
-	assert(tss);
-	soft = tss->ts;
-	hard = tss->ts + 2;
+	if (draining)
+		last_frame = mono_ns();
 
-	if (!ts_empty(hard))
+	if (!ts_empty(hard)) {
 		result = hard;
-	else if (!ts_empty(soft))
+		src = TS_HW;
+	} else if (!ts_empty(soft)) {
 		result = soft;
-	else
+		src = TS_SW;
+	} else {
+		/* Only now: the kernel has not timestamped the frame */
+		user_time(&ts);
 		result = &ts;
+		src = TS_USER;
+	}
 
-	mask(&signals);
-	fl_push(&stat, payload.seq, result);
-	umask(&signals);
+	/* The send time needs a host clock, the NIC's one will not do */
+	if (payload->hdr.magic == MAGIC_TS && ts_empty(soft) && src == TS_HW)
+		user_time(&ts);
+
+	guard_enter(&guard);
+	health.frames++;
+	health.tstamps[src]++;
+	if (payload->hdr.magic == MAGIC_TS)
+		add_latency(ts_empty(soft) ? &ts : soft, payload->tx_ns);
+	if (!payload_ts || trace)
+		fs_push(&stat, payload->hdr.seq, result, src);
+	if (guard_leave(&guard))
+		send_stats();
+
+	PROBE(rx_accept, payload->hdr.seq, flowid, result->tv_sec,
+	      result->tv_nsec, src);
+	*when = *result;
+	return 1;
+
+reject:
+	/* seq and flowid of a short frame are stale */
+	health.filtered[reason]++;
+	PROBE(rx_reject, payload->hdr.seq, payload->hdr.flowid, f->len,
+	      reason);
+	return 0;
 }
 
-int rx(unsigned int fid, int out)
+/* Receive into capture slots if there is room, else into bufs */
+static int setup_frames()
 {
-	master_pipe = out;
-	flowid = fid;
-	fl_clear(&stat);
+	int k, captured;
 
-	setup_sock();
-	setup_signals();
+	captured = capture && !capture_reserve(capture, cap_iovs, IO_BATCH);
+	for (k = 0; k < IO_BATCH; ++k)
+		frames[k].iov = (captured ? cap_iovs : iovs) + k;
+
+	return captured;
+}
+
+static void recv_batch()
+{
+	struct timespec left, *timeout = NULL, when;
+	int nr, k, captured;
+
+	if (draining) {
+		if (drain_wait(&left)) {
+			drain_finish();
+			return;
+		}
+		timeout = &left;
+	}
+
+	captured = setup_frames();
+	nr = io->ops->recv_batch(io, frames, IO_BATCH, timeout);
+	if (nr == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		perror("recv");
+		report_fail(1);
+	}
+
+	/* A stop without a drain window ends the trial at once */
+	for (k = 0; k < nr && running; ++k) {
+		if (!recv_pkt(frames + k, frames[k].iov->iov_base, &when))
+			continue;
+		if (captured)
+			capture_commit(capture, frames[k].iov->iov_base,
+				       frames[k].len, &when);
+		else if (capture)
+			health.uncaptured++;
+	}
+}
 
-	while (1) {
-		recv_pkt();
+static int setup_capture()
+{
+	if (!*ctl->capture)
+		return 0;
+
+	capture = capture_open(ctl->capture, ctl->capture_snap,
+			       ctl->capture_bytes, ctl->capture_files);
+	if (!capture)
+		return 1;
+
+	return 0;
+}
+
+/* After the trial: recv_batch() may have had slots when it stopped */
+static void stop_capture()
+{
+	if (capture)
+		capture_close(capture);
+	capture = NULL;
+}
+
+/*
+ * Trial control
+ */
+
+static int start()
+{
+	flowid = ctl->flowid;
+	payload_ts = ctl->payload_ts;
+	tsc_anchor();
+	stat.len = 0;
+	memset(&sum, 0, sizeof(sum));
+	memset(&health, 0, sizeof(health));
+	ctl->drain_ns = 0;
+
+	/* Throw away frames queued while we were idle */
+	if (io->ops->start(io, 0))
+		return 1;
+
+	if (setup_trace(ctl->trace) || setup_capture())
+		return 1;
+
+	running = 1;
+	return 0;
+}
+
+/* The io, the records and the frame buffers, see slave_exit() */
+static void cleanup()
+{
+	io->ops->close(io);
+	fs_free(&stat);
+	free(frames);
+	free(cap_iovs);
+	free(iovs);
+	free(bufs);
+}
+
+int rx(struct slave_ctl *c, struct ring *out)
+{
+	int err;
+
+	ctl = c;
+	master_ring = out;
+
+	if (slave_enter(ctl))
+		report_fail(1);
+
+	fs_init(&stat);
+
+	setup_io();
+	setup_signals();
+	report_success(ctl);
+
+	for (;;) {
+		switch (slave_wait_cmd(ctl)) {
+		case CMD_START:
+			err = start();
+			slave_ack(ctl, err);
+			while (running) {
+				recv_batch();
+				tsc_tick();
+			}
+			trace_detach_close(&trace);
+			stop_capture();
+			break;
+		case CMD_EXIT:
+			cleanup();
+			slave_ack(ctl, 0);
+			slave_exit(0);
+		default:
+			slave_ack(ctl, 1);
+		}
 	}
 }
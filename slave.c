@@ -0,0 +1,199 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "master.h"
+#include "export.h"
+#include "util.h"
+#include "ipc.h"
+#include "slave.h"
+
+/* Optional settings, see export.h */
+int slave_threads __attribute__((weak));
+char *tx_cpus __attribute__((weak));
+char *rx_cpus __attribute__((weak));
+char *tx_numa __attribute__((weak));
+char *rx_numa __attribute__((weak));
+int slave_rt_prio __attribute__((weak));
+
+/* SIGALRM and SIGSLAVE_* are all standard signals */
+#define SLAVE_NSIG 32
+
+/* tx and rx may share the process, so handlers are per thread */
+static SLAVE_LOCAL struct slave_ctl *self;
+static SLAVE_LOCAL void (*handlers[SLAVE_NSIG])(int);
+
+/* What the program had installed before the first slave_sigaction() */
+static struct sigaction chained[SLAVE_NSIG];
+static int saved[SLAVE_NSIG];
+static pthread_mutex_t saved_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int cpulist_parse(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	unsigned long first, last;
+
+	CPU_ZERO(set);
+
+	while (*p) {
+		first = last = strtoul(p, &end, 10);
+		if (end == p)
+			return 1;
+
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return 1;
+		}
+		if (last >= CPU_SETSIZE)
+			return 1;
+
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			++end;
+		else if (*end)
+			return 1;
+		p = end;
+	}
+
+	return !CPU_COUNT(set);
+}
+
+int slave_node(const char *ifname, const char *numa)
+{
+	char *end;
+	long node;
+
+	if (!numa)
+		return if_numa_node(ifname);
+
+	node = strtol(numa, &end, 10);
+	if (end == numa || *end || node < -1) {
+		ERR("bad numa node \"%s\"", numa);
+		return -1;
+	}
+
+	return node;
+}
+
+int slave_enter(struct slave_ctl *ctl)
+{
+	struct sched_param param = { .sched_priority = slave_rt_prio };
+	const char *cpus = *ctl->cpus ? ctl->cpus : NULL;
+	cpu_set_t set;
+	int err;
+
+	self = ctl;
+
+	if (ctl->node >= 0 && numa_prefer(ctl->node))
+		return 1;
+
+	NOTE("%s: numa node %d, cpus %s", ctl->ifname, ctl->node,
+	     cpus ?: "any");
+
+	if (cpus) {
+		if (cpulist_parse(cpus, &set)) {
+			ERR("bad cpu list \"%s\"", cpus);
+			return 1;
+		}
+
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err)
+			return errno = err, perror("pthread_setaffinity_np"), 1;
+	}
+
+	if (!slave_rt_prio)
+		return 0;
+
+	/* A page fault costs more than the scheduler saves */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		return perror("mlockall"), 1;
+
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err)
+		return errno = err, perror("pthread_setschedparam"), 1;
+
+	return 0;
+}
+
+void slave_exit(int code)
+{
+	if (!self || !self->threaded)
+		exit(code);
+
+	/* The master polls this instead of waitid() */
+	__atomic_store_n(&self->dead, 1, __ATOMIC_RELEASE);
+	futex_wake(&self->ack);
+	pthread_exit(NULL);
+}
+
+/* The program's handler gets whatever is not for the slave */
+static void chain(int signum, siginfo_t *info, void *uc)
+{
+	const struct sigaction *old = chained + signum;
+
+	if (old->sa_flags & SA_SIGINFO)
+		old->sa_sigaction(signum, info, uc);
+	else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+		old->sa_handler(signum);
+}
+
+static void dispatch(int signum, siginfo_t *info, void *uc)
+{
+	void (*handler)(int) = handlers[signum];
+
+	/* Threads: the master sends with pthread_kill() and the tx
+	 * timer targets its thread, anything else is process wide */
+	if (!handler || (self && self->threaded &&
+			 info->si_code != SI_TKILL &&
+			 info->si_code != SI_TIMER)) {
+		chain(signum, info, uc);
+		return;
+	}
+
+	handler(signum);
+}
+
+int slave_sigaction(int signum, void (*handler)(int))
+{
+	struct sigaction act = {
+		.sa_sigaction = dispatch,
+		.sa_flags = SA_SIGINFO,
+	};
+	sigset_t set;
+	int err;
+
+	assert(signum < SLAVE_NSIG);
+	handlers[signum] = handler;
+
+	sigemptyset(&act.sa_mask);
+	sigaddset(&act.sa_mask, SIGALRM);
+	sigaddset(&act.sa_mask, SIGSLAVE_STAT);
+	sigaddset(&act.sa_mask, SIGSLAVE_STOP);
+
+	/* Only the first slave to get here sees the program's handler */
+	pthread_mutex_lock(&saved_lock);
+	err = sigaction(signum, &act, saved[signum] ? NULL : chained + signum);
+	if (!err)
+		saved[signum] = 1;
+	pthread_mutex_unlock(&saved_lock);
+	if (err)
+		return perror("sigaction"), 1;
+
+	/* Slave threads start with every signal blocked */
+	sigemptyset(&set);
+	sigaddset(&set, signum);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Slave runtime
+ *
+ * Slaves run either as forked processes (default) or as threads
+ * of the program (slave_threads, see export.h).  tx.c and rx.c are
+ * the same in both modes and go through these helpers for whatever
+ * differs: termination, signal handlers, CPU placement and
+ * scheduling policy.
+ */
+
+#include <sched.h>
+
+/*
+ * Slave state.  Several slaves may run the same code as threads of
+ * one process, so file scope state in tx.c/rx.c is per thread.
+ * initial-exec keeps the access signal safe in a .so.
+ */
+#define SLAVE_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+struct slave_ctl;
+
+/* NUMA node for the slave of ifname, numa overrides sysfs */
+int slave_node(const char *ifname, const char *numa);
+
+/* Bind the calling slave to ctl, apply its NUMA node and CPU
+ * list and the real-time settings.  Returns 1 on error */
+int slave_enter(struct slave_ctl *ctl);
+
+/* Terminate the slave process or thread.  A thread leaves the
+ * process running, so the slave frees what it holds before */
+void slave_exit(int code) __attribute__((noreturn));
+
+/* Install handler for signum in the calling thread only, the
+ * other slave signals are blocked while it runs.  The program's
+ * own handler, if any, still gets the signals not meant for a slave */
+int slave_sigaction(int signum, void (*handler)(int));
+
+/* Parse a CPU list like "2,4-5", returns 1 on error */
+int cpulist_parse(const char *list, cpu_set_t *set);
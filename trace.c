@@ -0,0 +1,298 @@
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+#include <time.h>
+
+#include "debug.h"
+#include "util.h"
+#include "trace.h"
+
+/* Paths of the per-frame traces, NULL disables tracing */
+char *tx_trace __attribute__((weak));
+char *rx_trace __attribute__((weak));
+
+#define TRACE_BUFS 4
+#define TRACE_BUF_RECS (1 << 16)
+
+struct trace_buf {
+	int busy;		/* owned by the writer */
+	int len;
+	struct trace_rec rec[TRACE_BUF_RECS];
+};
+
+struct trace {
+	int fd;
+	pthread_t writer;
+	sem_t ready;		/* number of buffers passed to the writer */
+	int stop;
+
+	int cur;		/* buffer being filled */
+	int next;		/* buffer the writer is waiting for */
+	uint64_t dropped;
+
+	struct trace_buf buf[TRACE_BUFS];
+};
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	ssize_t err;
+
+	while (len) {
+		err = write(fd, data, len);
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += err;
+		len -= err;
+	}
+
+	return 0;
+}
+
+static void *writer(void *arg)
+{
+	struct trace *tr = arg;
+	struct trace_buf *b;
+	int err;
+
+	for (;;) {
+		while (sem_wait(&tr->ready) && errno == EINTR)
+			;
+
+		b = tr->buf + tr->next;
+		if (!__atomic_load_n(&b->busy, __ATOMIC_ACQUIRE)) {
+			/* Woken up with nothing to write: trace_close() */
+			assert(__atomic_load_n(&tr->stop, __ATOMIC_ACQUIRE));
+			return NULL;
+		}
+
+		err = write_all(tr->fd, b->rec, b->len * sizeof(*b->rec));
+		if (err)
+			perror("write(trace)");
+
+		b->len = 0;
+		__atomic_store_n(&b->busy, 0, __ATOMIC_RELEASE);
+		tr->next = (tr->next + 1) % TRACE_BUFS;
+	}
+}
+
+/*
+ * A pinned real-time slave would starve the writer on its own CPUs,
+ * so the writer gets default scheduling and the remaining CPUs.
+ */
+static void writer_attr(pthread_attr_t *attr)
+{
+	cpu_set_t own, rest;
+	int i;
+
+	pthread_attr_init(attr);
+	pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(own), &own))
+		return;
+
+	CPU_ZERO(&rest);
+	for (i = 0; i < get_nprocs_conf() && i < CPU_SETSIZE; ++i)
+		if (!CPU_ISSET(i, &own))
+			CPU_SET(i, &rest);
+
+	if (CPU_COUNT(&rest))
+		pthread_attr_setaffinity_np(attr, sizeof(rest), &rest);
+}
+
+int writer_start(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int err;
+
+	/* Slave signals must never be delivered to the writer */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	writer_attr(&attr);
+	err = pthread_create(thread, &attr, fn, arg);
+	if (err == EINVAL) {
+		/* The other CPUs may be outside of our cpuset */
+		err = pthread_create(thread, NULL, fn, arg);
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		return perror("pthread_create"), 1;
+	}
+
+	return 0;
+}
+
+struct trace *trace_open(const char *path, const struct trace_hdr *hdr)
+{
+	struct trace *tr;
+	int err;
+
+	tr = calloc(1, sizeof(*tr));
+	if (!tr)
+		return perror("calloc"), NULL;
+
+	tr->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tr->fd == -1) {
+		perror("open(trace)");
+		goto free;
+	}
+
+	err = write_all(tr->fd, hdr, sizeof(*hdr));
+	if (err) {
+		perror("write(trace)");
+		goto close;
+	}
+
+	sem_init(&tr->ready, 0, 0);
+	if (writer_start(&tr->writer, writer, tr))
+		goto close;
+
+	return tr;
+
+close:
+	close(tr->fd);
+free:
+	free(tr);
+	return NULL;
+}
+
+/* Pass the current buffer to the writer (sem_post is signal safe) */
+static void trace_submit(struct trace *tr)
+{
+	struct trace_buf *b = tr->buf + tr->cur;
+
+	if (!b->len)
+		return;
+
+	__atomic_store_n(&b->busy, 1, __ATOMIC_RELEASE);
+	sem_post(&tr->ready);
+	tr->cur = (tr->cur + 1) % TRACE_BUFS;
+}
+
+void trace_put(struct trace *tr, const struct fdata *fdata, uint32_t flowid)
+{
+	struct trace_buf *b = tr->buf + tr->cur;
+	struct trace_rec *rec;
+
+	if (__atomic_load_n(&b->busy, __ATOMIC_ACQUIRE)) {
+		tr->dropped++;
+		return;
+	}
+
+	rec = b->rec + b->len++;
+	rec->ts = fdata->ts.tv_sec * 1000000000ull + fdata->ts.tv_nsec;
+	rec->seq = fdata->id;
+	rec->flowid = flowid;
+	rec->src = fdata->src;
+
+	if (b->len == TRACE_BUF_RECS)
+		trace_submit(tr);
+}
+
+void trace_array(struct trace *tr, const struct fdata *rec, uint32_t nr,
+		 uint32_t flowid)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr; ++i)
+		trace_put(tr, rec + i, flowid);
+}
+
+void trace_close(struct trace *tr)
+{
+	trace_submit(tr);
+
+	__atomic_store_n(&tr->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&tr->ready);
+	pthread_join(tr->writer, NULL);
+
+	if (tr->dropped)
+		ERR("trace: %llu records dropped",
+		    (unsigned long long)tr->dropped);
+
+	close(tr->fd);
+	sem_destroy(&tr->ready);
+	free(tr);
+}
+
+void trace_detach_close(struct trace **trp)
+{
+	struct trace *tr = *trp;
+
+	*trp = NULL;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (tr)
+		trace_close(tr);
+}
+
+/*
+ * Reading traces
+ */
+
+const struct trace_hdr *trace_map(const char *path, size_t *nr)
+{
+	const struct trace_hdr *hdr;
+	struct stat st;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return perror(path), NULL;
+
+	err = fstat(fd, &st);
+	if (err) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		ERR("%s: not a trace", path);
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return perror("mmap"), NULL;
+
+	if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION) {
+		ERR("%s: bad trace magic/version", path);
+		munmap((void *)hdr, st.st_size);
+		return NULL;
+	}
+
+	if (hdr->frame_len > sizeof(hdr->frame)) {
+		ERR("%s: bad frame length %u", path, hdr->frame_len);
+		munmap((void *)hdr, st.st_size);
+		return NULL;
+	}
+
+	*nr = (st.st_size - sizeof(*hdr)) / sizeof(struct trace_rec);
+	return hdr;
+}
+
+void trace_unmap(const struct trace_hdr *hdr, size_t nr)
+{
+	munmap((void *)hdr, sizeof(*hdr) + nr * sizeof(struct trace_rec));
+}
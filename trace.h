@@ -0,0 +1,80 @@
+/*
+ * Per-frame binary traces
+ *
+ * Every record a slave hands to the master can also be written
+ * to a trace file.  The file is a trace_hdr followed by an array
+ * of trace_rec.  Records are buffered in memory and written by a
+ * separate thread, so the slave never waits for the disk; if the
+ * writer falls behind, records are dropped and counted instead.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define TRACE_MAGIC 0x52544746	/* "FGTR" */
+#define TRACE_VERSION 1
+
+enum trace_dir {
+	TRACE_TX,
+	TRACE_RX,
+};
+
+struct trace_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t dir;		/* enum trace_dir */
+	uint32_t flowid;
+	uint32_t fsize;		/* 0 if unknown (rx) */
+	uint32_t frame_len;	/* bytes used in frame */
+	uint8_t frame[64];	/* L2-L4 headers of the test frames */
+} __attribute__((packed));
+
+struct trace_rec {
+	uint64_t ts;		/* nanoseconds since the epoch */
+	uint32_t seq;
+	uint32_t flowid;
+	uint8_t src;		/* enum ts_src */
+} __attribute__((packed));
+
+struct trace;
+struct fdata;
+
+/*
+ * Start a writer thread of a slave, also for the capture: no signals,
+ * default scheduling and the CPUs the slave is not pinned to.
+ */
+int writer_start(pthread_t *thread, void *(*fn)(void *), void *arg);
+
+/* Create trace file and start the writer, NULL on error */
+struct trace *trace_open(const char *path, const struct trace_hdr *hdr);
+
+/* Queue one record, never blocks */
+void trace_put(struct trace *tr, const struct fdata *fdata, uint32_t flowid);
+
+/* Queue nr records */
+void trace_array(struct trace *tr, const struct fdata *rec, uint32_t nr,
+		 uint32_t flowid);
+
+/* Write everything queued, stop the writer and close the file */
+void trace_close(struct trace *tr);
+
+/*
+ * Clear *trp, so that a late signal handler no longer queues to it,
+ * then trace_close() it.  From the slave's main loop: trace_close()
+ * joins the writer, which is no business of a signal handler.
+ */
+void trace_detach_close(struct trace **trp);
+
+/* Map trace file into memory, NULL on error */
+const struct trace_hdr *trace_map(const char *path, size_t *nr);
+
+static inline const struct trace_rec *trace_recs(const struct trace_hdr *hdr)
+{
+	return (const struct trace_rec *)(hdr + 1);
+}
+
+void trace_unmap(const struct trace_hdr *hdr, size_t nr);
+
+/* Merge traces by timestamp and write them as pcapng */
+int trace_export_pcapng(const char **paths, int nr, FILE *out);
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../trace.h"
+
+/* The library expects these to be exported */
+char *rx_ifname = "";
+char *tx_ifname = "";
+
+int main(int argc, char **argv)
+{
+	FILE *out;
+	int err;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s OUT.pcapng TRACE...\n", argv[0]);
+		return 1;
+	}
+
+	out = fopen(argv[1], "w");
+	if (!out)
+		return perror(argv[1]), 1;
+
+	err = trace_export_pcapng((const char **)argv + 2, argc - 2, out);
+
+	if (fclose(out))
+		return perror("fclose"), 1;
+
+	return err;
+}
@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "util.h"
+#include "tsc.h"
+
+#ifdef HAVE_TSC
+#include <cpuid.h>
+#endif
+
+#define CALIB_NS (50 * 1000 * 1000)
+#define CALIB_TRIES 16
+#define MAX_PPM 1000	/* further off the calibration is a step */
+
+struct tsc_clock tsc_clock;
+SLAVE_LOCAL struct tsc_anchor tsc_base[2];
+SLAVE_LOCAL volatile int tsc_cur;
+
+/* Constant rate in all P-, C- and T-states */
+static int tsc_invariant()
+{
+#ifdef HAVE_TSC
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+		return 0;
+	return !!(d & (1 << 8));
+#else
+	return 0;
+#endif
+}
+
+/* The kernel switches away from the TSC once it finds it unstable
+ * or out of sync between CPUs */
+static int tsc_trusted()
+{
+	char buf[32];
+
+	if (!read_line("/sys/devices/system/clocksource/clocksource0/"
+		       "current_clocksource", buf, sizeof(buf)))
+		return 0;
+
+	return !strcmp(buf, "tsc");
+}
+
+/*
+ * TSC and clk at the same moment: the pair of TSC reads closest
+ * around clock_gettime() of a few tries.  A preempted try would skew
+ * the scale by far more than the calibration is good for otherwise.
+ */
+static void sample(clockid_t clk, uint64_t *tsc, uint64_t *ns)
+{
+	struct timespec ts;
+	uint64_t before, after, best = -1;
+	int i;
+
+	for (i = 0; i < CALIB_TRIES; ++i) {
+		before = tsc_read();
+		clock_gettime(clk, &ts);
+		after = tsc_read();
+
+		if (after - before < best) {
+			best = after - before;
+			*tsc = before + best / 2;
+			*ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		}
+	}
+}
+
+void tsc_init()
+{
+	static const struct timespec wait = { .tv_nsec = CALIB_NS };
+	uint64_t c0, c1, t0, t1;
+
+	if (tsc_clock.ok)
+		return;
+
+	if (!tsc_invariant() || !tsc_trusted()) {
+		NOTE("user timestamps: clock_gettime");
+		return;
+	}
+
+	sample(CLOCK_MONOTONIC_RAW, &c0, &t0);
+	nanosleep(&wait, NULL);
+	sample(CLOCK_MONOTONIC_RAW, &c1, &t1);
+
+	if (c1 <= c0 || t1 <= t0) {
+		NOTE("user timestamps: clock_gettime, tsc calibration failed");
+		return;
+	}
+
+	tsc_clock.mult = ((unsigned __int128)(t1 - t0) << 32) / (c1 - c0);
+	tsc_clock.period = ((unsigned __int128)TSC_ANCHOR_NS << 32) /
+		tsc_clock.mult;
+	tsc_clock.ok = 1;
+
+	NOTE("user timestamps: tsc, %.3f MHz",
+	     (c1 - c0) * 1e3 / (t1 - t0));
+}
+
+/* Switch user_time() over to the new anchor, signal safe */
+static void anchor_set(uint64_t tsc, uint64_t ns, uint64_t mult)
+{
+	struct tsc_anchor *next = tsc_base + !tsc_cur;
+
+	next->tsc = tsc;
+	next->ns = ns;
+	next->mult = mult;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	tsc_cur = !tsc_cur;
+}
+
+void tsc_anchor()
+{
+	const struct tsc_anchor *a = tsc_base + tsc_cur;
+	uint64_t tsc, ns;
+
+	if (!tsc_clock.ok)
+		return;
+
+	/* The rate of the last trial still holds */
+	sample(CLOCK_REALTIME, &tsc, &ns);
+	anchor_set(tsc, ns, a->mult ?: tsc_clock.mult);
+}
+
+void tsc_tick()
+{
+	const struct tsc_anchor *a = tsc_base + tsc_cur;
+	uint64_t tsc, ns, mult, dev;
+
+	if (!tsc_clock.ok || tsc_read() - a->tsc < tsc_clock.period)
+		return;
+
+	sample(CLOCK_REALTIME, &tsc, &ns);
+	mult = ns > a->ns ? ((unsigned __int128)(ns - a->ns) << 32) /
+		(tsc - a->tsc) : 0;
+
+	/* REALTIME was stepped: follow it, but keep the rate */
+	dev = mult > tsc_clock.mult ? mult - tsc_clock.mult :
+		tsc_clock.mult - mult;
+	if (dev > tsc_clock.mult / (1000000 / MAX_PPM))
+		mult = a->mult;
+
+	anchor_set(tsc, ns, mult);
+}
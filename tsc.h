@@ -0,0 +1,79 @@
+/*
+ * User space timestamps, for frames the kernel gave no timestamp
+ *
+ * With an invariant TSC the clock is the TSC itself, no syscall.  It
+ * is anchored to CLOCK_REALTIME at the start of each trial and again
+ * every TSC_ANCHOR_NS from the slave's main loop.  The scale starts
+ * calibrated against CLOCK_MONOTONIC_RAW, then comes from the last two
+ * anchors: it follows REALTIME's NTP corrected rate, as the kernel
+ * timestamps the user ones are compared with do.  Otherwise (other
+ * arches, or the kernel does not trust the TSC) it is
+ * clock_gettime(CLOCK_REALTIME).
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "slave.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define TSC_ANCHOR_NS (100 * 1000 * 1000)
+
+struct tsc_clock {
+	int ok;			/* use the TSC */
+	uint64_t mult;		/* ns per tick << 32, calibrated */
+	uint64_t period;	/* ticks in TSC_ANCHOR_NS */
+};
+
+/* Anchor of the calling slave, see tsc_anchor() */
+struct tsc_anchor {
+	uint64_t tsc;
+	uint64_t ns;		/* CLOCK_REALTIME at tsc */
+	uint64_t mult;		/* ns per tick << 32, REALTIME's rate */
+};
+
+/* user_time() reads tsc_base[tsc_cur], a new anchor goes into the
+ * other one first: a signal handler never sees half of it */
+extern struct tsc_clock tsc_clock;
+extern SLAVE_LOCAL struct tsc_anchor tsc_base[2];
+extern SLAVE_LOCAL volatile int tsc_cur;
+
+/* Check and calibrate the TSC, once before the slaves start */
+void tsc_init(void);
+
+/* Slave: take CLOCK_REALTIME as the base for user_time() */
+void tsc_anchor(void);
+
+/* Slave main loop: anchor again once TSC_ANCHOR_NS have passed */
+void tsc_tick(void);
+
+static inline uint64_t tsc_read(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* CLOCK_REALTIME based timestamp, signal safe */
+static inline void user_time(struct timespec *ts)
+{
+	const struct tsc_anchor *a;
+	uint64_t ns;
+
+	if (!tsc_clock.ok) {
+		clock_gettime(CLOCK_REALTIME, ts);
+		return;
+	}
+
+	a = tsc_base + tsc_cur;
+	ns = a->ns + (uint64_t)(((unsigned __int128)
+		(tsc_read() - a->tsc) * a->mult) >> 32);
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
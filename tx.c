@@ -1,72 +1,155 @@
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
 
-#include <sys/socket.h>
-#include <netpacket/packet.h>
-#include <net/ethernet.h> /* the L2 protocols */
-
 #include <unistd.h>
-#include <net/if.h>
-
-#include <linux/net_tstamp.h>
+#include <net/ethernet.h>
 
 #include <time.h>
 
 #include "export.h"
 #include "master.h"
-#include "ipc.h"
 #include "util.h"
+#include "ipc.h"
+#include "trace.h"
+#include "ring.h"
+#include "tsc.h"
+#include "probe.h"
+#include "io.h"
+#include "pcap.h"
+
+static SLAVE_LOCAL struct slave_ctl *ctl;
+static SLAVE_LOCAL struct ring *master_ring;
+static SLAVE_LOCAL header_cfg_t header;
+static SLAVE_LOCAL unsigned int flowid, fsize;
+static SLAVE_LOCAL uint32_t pktnum;
+static SLAVE_LOCAL volatile sig_atomic_t running;
+static SLAVE_LOCAL struct timespec stop_at;	/* zero - not scheduled */
+static SLAVE_LOCAL int payload_ts;	/* count frames, send no records */
+static SLAVE_LOCAL volatile sig_atomic_t send_errno;	/* fatal, 0 - none */
+
+/*
+ * Absolute schedule: frame slot k is due at first_ns + k * interval_ns
+ * (CLOCK_MONOTONIC).  A late SIGALRM coalesces with the ones it
+ * missed, so send_frame() counts the slots due by now rather than
+ * the signals.
+ */
+static SLAVE_LOCAL uint64_t first_ns, interval_ns;
+static SLAVE_LOCAL uint64_t slots;	/* sent or skipped */
+static SLAVE_LOCAL unsigned int catchup;	/* extra frames per tick */
 
-//#define ENABLE_TX_SCHED
+/*
+ * pcap replay (tx_pcap).  Frame k of the trial is frame k % nr of the
+ * file, due at first_ns plus k intervals or plus its time in the file
+ * over replay_speed.  A tick sends the frames due by now in batches
+ * and arms the timer for the next one, REPLAY_TICK_NS later at the
+ * earliest: closer frames go out together.  Nothing is skipped, late
+ * frames count in health.catchup.
+ */
+#define REPLAY_TICK_NS 10000
+#define REPLAY_BATCHES 8	/* of IO_BATCH frames, most per tick */
 
-static int master_pipe;
-static unsigned int flowid, fsize;
-static uint32_t pktnum;
+/* Headers and test payload of a tagged frame, the rest is the file's */
+struct replay_buf {
+	uint8_t hdr[HEADERS_LEN];
+	struct payload_ts payload;
+} __attribute__((packed));
 
-static struct flist_head stat;
+static SLAVE_LOCAL struct replay *replay;
+static SLAVE_LOCAL struct replay_buf *replay_bufs;	/* IO_BATCH */
+static SLAVE_LOCAL double replay_speed;	/* 0 - at the rate */
+static SLAVE_LOCAL uint64_t replay_next;	/* frame k to send */
 
 /*
- * Frame/Socket initialization
+ * Every frame gets one record with the best timestamp it has.  The
+ * kernel reports timestamps by the OPT_ID counter, which is pktnum:
+ * send_frame() leaves the user timestamp in pending[] and
+ * tx_tstamp() takes the slot when the final kernel timestamp comes.
+ * A frame the kernel never reports is given up when its slot is
+ * reused or the trial stops; its record then has the software
+ * timestamp, if any, or the user one.  key is id + 1 while the frame
+ * waits; whoever clears it pushes the record.  Replayed frames with
+ * no test payload wait too, but only to take their timestamps away.
  */
+#define PENDING_ORDER 14
+#define PENDING_MASK ((1u << PENDING_ORDER) - 1)
 
-static int sockfd;
+struct pending {
+	uint32_t key;
+	uint32_t kkey;		/* key of kts */
+	uint8_t ksrc;
+	uint8_t skip;		/* untagged, no record */
+	struct timespec ts;	/* user timestamp */
+	struct timespec kts;	/* software one while the NIC's is due */
+};
 
-static void setup_sock()
-{
-	int err;
-	int val;
+static SLAVE_LOCAL struct pending *pending;
+static SLAVE_LOCAL enum ts_src final_src;	/* what to wait for */
 
-	sockfd = socket(AF_PACKET, SOCK_RAW, 0);
-	if (sockfd == -1) {
-		perror("socket");
-		exit(1);
-	}
+/*
+ * Given up frames are pushed by send_frame() (SIGALRM), kernel
+ * timestamps by tx_tstamp() in the main loop.  The stat snapshot runs either in
+ * a SIGSLAVE_* handler or, if tx_tstamp() was interrupted in the
+ * middle of a push, right after it in the main loop, where SIGALRM
+ * may still arrive.  So send_frame() gets two segments: the snapshot
+ * switches it to the other one before publishing the old one.
+ */
+static SLAVE_LOCAL struct fseg sent[2];
+static SLAVE_LOCAL int sent_active;
+static SLAVE_LOCAL struct fseg tstamps;
+static SLAVE_LOCAL struct guard guard;
+static SLAVE_LOCAL volatile sig_atomic_t stopping;
 
-	val = SOF_TIMESTAMPING_TX_HARDWARE |
-#ifdef ENABLE_TX_SCHED
-		SOF_TIMESTAMPING_TX_SCHED |
-#endif
-		SOF_TIMESTAMPING_TX_SOFTWARE |
-		SOF_TIMESTAMPING_SOFTWARE |
-		SOF_TIMESTAMPING_RAW_HARDWARE;
+static SLAVE_LOCAL struct trace *trace;
 
-	err = setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
-	if (err) {
-		perror("setsockopt");
-		exit(1);
-	}
+/*
+ * Each counter has one writer context, but ts_missing: give_up()
+ * runs both in SIGALRM and in the snapshot it may interrupt.
+ */
+static SLAVE_LOCAL struct framegen_health health;
+
+/*
+ * Frame initialization
+ */
+
+static SLAVE_LOCAL struct io *io;
+
+/* The frames of a tick go out together, each with its own payload */
+static SLAVE_LOCAL struct iovec iov[IO_BATCH][4];
+static SLAVE_LOCAL uint8_t *payloads;
+static SLAVE_LOCAL int payload_len, payload_cap;
 
-	/*
-	 * Should we setsockopt(..., SOL_PACKET, PACKET_QDISC_BYPASS ...) here?
-	 */
+static inline struct payload *frame_payload(int i)
+{
+	return (struct payload *)(payloads + i * payload_len);
+}
+
+static void setup_io()
+{
+	const struct io_ops *ops = io_find(ctl->io);
+
+	io = ops ? ops->open(ctl, 1) : NULL;
+	if (!io)
+		report_fail(1);
 }
 
-static struct iovec iov[4];
-static struct sockaddr_ll addr;
-static struct msghdr msg;
-struct payload *payload;
+static void setup_replay()
+{
+	if (!*ctl->pcap)
+		return;
+
+	replay = replay_open(ctl->pcap);
+	if (!replay)
+		report_fail(1);
+
+	replay_bufs = calloc(IO_BATCH, sizeof(*replay_bufs));
+	if (!replay_bufs) {
+		perror("calloc");
+		report_fail(1);
+	}
+}
 
 void ip_checksum(struct iphdr *ip)
 {
@@ -88,47 +171,70 @@ void ip_checksum(struct iphdr *ip)
 	ip->check = ~sum;
 }
 
-static void setup_frame(header_cfg_t *header)
+static void setup_frame()
 {
-	int payload_len = fsize - HEADERS_LEN;
+	int udp_len, ip_len, i;
 
-	int udp_len = sizeof(header->udp) + payload_len;
-	int ip_len  = sizeof(header->ip) + udp_len;
+	payload_len = fsize - HEADERS_LEN;
+	udp_len = sizeof(header.udp) + payload_len;
+	ip_len  = sizeof(header.ip) + udp_len;
 
-	header->ip.tot_len = htons(ip_len);
-	header->udp.len = htons(udp_len);
+	header.ip.tot_len = htons(ip_len);
+	header.udp.len = htons(udp_len);
 
-	ip_checksum(&header->ip);
+	ip_checksum(&header.ip);
 
-	iov[0].iov_base = &header->eth;
-	iov[0].iov_len  = sizeof(header->eth);
+	/* The buffers are kept between trials */
+	if (payload_len > payload_cap) {
+		payloads = realloc(payloads, IO_BATCH * payload_len);
+		assert(payloads);
+		memset(payloads, 0, IO_BATCH * payload_len);
+		payload_cap = payload_len;
+	}
 
-	iov[1].iov_base = &header->ip;
-	iov[1].iov_len  = sizeof(header->ip);
+	for (i = 0; i < IO_BATCH; ++i) {
+		iov[i][0].iov_base = &header.eth;
+		iov[i][0].iov_len  = sizeof(header.eth);
 
-	iov[2].iov_base = &header->udp;
-	iov[2].iov_len  = sizeof(header->udp);
+		iov[i][1].iov_base = &header.ip;
+		iov[i][1].iov_len  = sizeof(header.ip);
 
-	payload = malloc(payload_len);
-	iov[3].iov_base = payload;
-	iov[3].iov_len  = payload_len;
+		iov[i][2].iov_base = &header.udp;
+		iov[i][2].iov_len  = sizeof(header.udp);
 
-	payload->magic = MAGIC;
-	payload->flowid = flowid;
+		iov[i][3].iov_base = frame_payload(i);
+		iov[i][3].iov_len  = payload_len;
 
-	addr.sll_family = AF_PACKET;
-	addr.sll_ifindex = if_nametoindex(tx_ifname);
+		frame_payload(i)->magic = payload_ts ? MAGIC_TS : MAGIC;
+		frame_payload(i)->flowid = flowid;
+	}
+}
+
+static int setup_trace(const char *path)
+{
+	struct trace_hdr hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.dir = TRACE_TX,
+		.flowid = flowid,
+		.fsize = fsize,
+		.frame_len = HEADERS_LEN,
+	};
+	int i, off = 0;
+
+	if (!*path)
+		return 0;
 
-	if (!addr.sll_ifindex) {
-		perror("if_nametoindex");
-		ERR("can't get rx interface index");
-		exit(1);
+	for (i = 0; i < 3; ++i) {
+		memcpy(hdr.frame + off, iov[0][i].iov_base, iov[0][i].iov_len);
+		off += iov[0][i].iov_len;
 	}
 
-	msg.msg_name = &addr;
-	msg.msg_namelen = sizeof(addr);
-	msg.msg_iov = iov;
-	msg.msg_iovlen = sizeof(iov)/sizeof(*iov);
+	trace = trace_open(path, &hdr);
+	if (!trace)
+		return 1;
+
+	return 0;
 }
 
 /*
@@ -139,34 +245,12 @@ static void send_frame(int signum);
 static void send_stats(int signum);
 static void stop(int sugnum);
 
-static sigset_t signals;
-
-static void set_handler(int signum, void (*handler)(int))
-{
-	int err;
-	struct sigaction act = {
-		.sa_mask = signals,
-		.sa_handler = handler,
-	};
-
-	err = sigaction(signum, &act, NULL);
-	if (err) {
-		perror("sigaction");
-		exit(1);
-	}
-}
-
-
 static void setup_signals()
 {
-	sigemptyset(&signals);
-	sigaddset(&signals, SIGALRM);
-	sigaddset(&signals, SIGSLAVE_STAT);
-	sigaddset(&signals, SIGSLAVE_STOP);
-
-	set_handler(SIGALRM, send_frame);
-	set_handler(SIGSLAVE_STAT, send_stats);
-	set_handler(SIGSLAVE_STOP, stop);
+	if (slave_sigaction(SIGALRM, send_frame) ||
+	    slave_sigaction(SIGSLAVE_STAT, send_stats) ||
+	    slave_sigaction(SIGSLAVE_STOP, stop))
+		report_fail(1);
 }
 
 
@@ -174,15 +258,19 @@ static void setup_signals()
  * Timer initialization
  */
 
-static void rate_to_tv(ethrate_t *rate, struct timeval *tv)
+static SLAVE_LOCAL timer_t timer;
+
+static void rate_to_ts(ethrate_t *rate, unsigned int size,
+		       struct timespec *ts)
 {
-	static const long mega = 1000 * 1000;
+	static const long giga = 1000 * 1000 * 1000;
 	double val = rate->val;
+	long long ns;
 
 	switch (rate->units) {
 	case RATE_PERCENT:
 		ERR("rate->units == RATE_PERCENT");
-		exit(1);
+		report_fail(1);
 	case RATE_KBPS:
 		val *= 1000;
 	case RATE_MBPS:
@@ -192,151 +280,582 @@ static void rate_to_tv(ethrate_t *rate, struct timeval *tv)
 		break;
 	default:
 		ERR("uknown rate units");
-		exit(1);
+		report_fail(1);
 	}
 
 	val /= 8;		/* bytes per second */
-	val /= fsize;		/* frames per second */
-
-	tv->tv_sec = 1 / val;	/* interval in seconds */
-	tv->tv_usec = mega / val;
-	tv->tv_usec %= mega;	/* interval in microseconds */
+	val /= size;		/* frames per second */
+
+	/* Interval in nanoseconds.  Never 0: that disarms the timer
+	 * and the schedule divides by it */
+	ns = giga / val;
+	if (ns < 1)
+		ns = 1;
+	ts->tv_sec = ns / giga;
+	ts->tv_nsec = ns % giga;
 }
 
-static void setup_timer(ethrate_t *rate)
+/*
+ * SIGALRM goes to this thread only: in threaded mode a process
+ * timer would hit whichever thread does not block it.
+ */
+static void create_timer()
 {
+	struct sigevent sev = {
+		.sigev_notify = SIGEV_THREAD_ID,
+		.sigev_signo = SIGALRM,
+	};
 	int err;
-	struct itimerval timer = {};
 
-	rate_to_tv(rate, &timer.it_interval);
-	timer.it_value = timer.it_interval;
+	sev._sigev_un._tid = syscall(SYS_gettid);
 
-	err = setitimer(ITIMER_REAL, &timer, NULL);
+	err = timer_create(CLOCK_MONOTONIC, &sev, &timer);
 	if (err) {
-		perror("setitimer");
-		exit(0);
+		perror("timer_create");
+		report_fail(1);
 	}
 }
 
+/* First frame at start (CLOCK_MONOTONIC) or one interval from now */
+static int setup_timer(ethrate_t *rate, struct timespec *start)
+{
+	int err;
+	struct itimerspec its = {};
+
+	if (replay && replay_speed) {
+		/* The mean gap, for the stats only */
+		interval_ns = replay->period_ns / replay->nr / replay_speed;
+		if (!interval_ns)
+			interval_ns = 1;
+	} else {
+		rate_to_ts(rate, replay ? replay->bytes / replay->nr : fsize,
+			   &its.it_interval);
+		interval_ns = its.it_interval.tv_sec * 1000000000ull +
+			its.it_interval.tv_nsec;
+	}
+	ctl->interval_ns = interval_ns;
+
+	/* Replay arms the timer for every tick itself */
+	if (replay)
+		memset(&its.it_interval, 0, sizeof(its.it_interval));
+
+	/* Absolute either way, the schedule needs to know it */
+	if (!ts_empty(start))
+		first_ns = start->tv_sec * 1000000000ull + start->tv_nsec;
+	else
+		first_ns = mono_ns() + interval_ns;
+	its.it_value.tv_sec = first_ns / 1000000000;
+	its.it_value.tv_nsec = first_ns % 1000000000;
+	slots = 0;
+
+	err = timer_settime(timer, TIMER_ABSTIME, &its, NULL);
+	if (err)
+		return perror("timer_settime"), 1;
+
+	return 0;
+}
+
+static void arm_timer(uint64_t at)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec = at / 1000000000,
+		.it_value.tv_nsec = at % 1000000000,
+	};
+
+	timer_settime(timer, TIMER_ABSTIME, &its, NULL);
+}
+
+/* Signal safe */
+static void stop_timer()
+{
+	struct itimerspec its = {};
+
+	timer_settime(timer, 0, &its, NULL);
+}
+
 
 /*
  * Signal hanlers
  */
 
-static void send_frame(int sugnum)
+static void give_up(struct pending *p, uint32_t key, struct fseg *seg)
 {
-	int err;
-	struct timespec ts;
+	if (p->skip)
+		return;
+
+	__atomic_fetch_add(&health.ts_missing, 1, __ATOMIC_RELAXED);
+	if (p->kkey == key)
+		fs_push(seg, key - 1, &p->kts, p->ksrc);
+	else
+		fs_push(seg, key - 1, &p->ts, TS_USER);
+}
+
+static void wait_tstamp(uint32_t id, const struct timespec *ts, int skip)
+{
+	struct pending *p = pending + (id & PENDING_MASK);
+	uint32_t key;
 
-	payload->seq = pktnum;
+	key = __atomic_exchange_n(&p->key, 0, __ATOMIC_RELAXED);
+	if (key)
+		give_up(p, key, sent + sent_active);
 
-	err = clock_gettime(CLOCK_REALTIME, &ts);
-	if (err == -1) {
-		perror("clock_gettime");
-		exit(1);
+	p->ts = *ts;
+	p->skip = skip;
+	__atomic_store_n(&p->key, id + 1, __ATOMIC_RELAXED);
+}
+
+/* The last trial frames get no more time than the stop */
+static void give_up_all(struct fseg *seg)
+{
+	uint32_t i, key;
+
+	for (i = 0; i <= PENDING_MASK; ++i) {
+		key = __atomic_exchange_n(&pending[i].key, 0, __ATOMIC_RELAXED);
+		if (key)
+			give_up(pending + i, key, seg);
 	}
-	err = sendmsg(sockfd, &msg, 0);
-	if (err == -1) {
-		perror("sendmsg");
-		exit(1);
+}
+
+/* Frame pktnum went out at ts */
+static void frame_sent(const struct timespec *ts, int tagged)
+{
+	if (!tagged) {
+		health.untagged++;
+		if (!payload_ts)
+			wait_tstamp(pktnum, ts, 1);
+		++pktnum;
+		return;
 	}
 
-	fl_push(&stat, pktnum, &ts);
+	health.frames++;
+	if (!payload_ts)
+		wait_tstamp(pktnum, ts, 0);
+	else if (trace)
+		fs_push(sent + sent_active, pktnum, ts, TS_USER);
 	++pktnum;
 }
 
-static void send_stats(int signum)
+/* Sending frame pktnum failed, errno says why */
+static void send_failed()
 {
-	fl_send(&stat, master_pipe);
-	fl_free(&stat);
+	health.errors[errno < FRAMEGEN_NERRNO ? errno : FRAMEGEN_NERRNO - 1]++;
+	switch (errno) {
+	case ENOBUFS:
+		/* Dropped by the qdisc or driver: the frame is lost,
+		 * but it took its OPT_ID */
+		++pktnum;
+		return;
+	case ENETDOWN:
+		/* Link flap, try the next one */
+		return;
+	case EAGAIN:
+		/* udp: the socket buffer is full, the frame is lost
+		 * before it took an id */
+		return;
+	case EMSGSIZE:
+		/* A captured frame over the MTU, skip it.  Ours are
+		 * never that long, so it is fatal for them */
+		if (replay)
+			return;
+		/* fall through */
+	default:
+		/* Give up from the main loop, slave_exit() is no
+		 * business of SIGALRM */
+		send_errno = errno;
+		running = 0;
+		stop_timer();
+	}
 }
 
-static void stop(int signum)
+/* n frames, IO_BATCH per send_batch().  A failed one is dropped and
+ * the frames after it get the next ids */
+static void send_burst(unsigned int n)
 {
-	INFO("stopping");
-	send_stats(signum);
-	exit(0);
+	struct io_frame f[IO_BATCH];
+	struct payload *p;
+	struct timespec ts;
+	int i, nr, ret;
+
+	while (n && running) {
+		nr = n < IO_BATCH ? n : IO_BATCH;
+
+		user_time(&ts);
+		for (i = 0; i < nr; ++i) {
+			p = frame_payload(i);
+			p->seq = pktnum + i;
+			if (payload_ts)
+				((struct payload_ts *)p)->tx_ns =
+					ts.tv_sec * 1000000000ull + ts.tv_nsec;
+			f[i] = (struct io_frame) {
+				.iov = iov[i],
+				.iovlen = 4,
+				.id = pktnum + i,
+			};
+		}
+
+		ret = io->ops->send_batch(io, f, nr);
+		for (i = 0; i < ret; ++i) {
+			PROBE(tx_send, pktnum, flowid,
+			      ts.tv_sec, ts.tv_nsec, 1);
+			frame_sent(&ts, 1);
+		}
+
+		if (i < nr) {
+			PROBE(tx_send, pktnum, flowid,
+			      ts.tv_sec, ts.tv_nsec, -1);
+			send_failed();
+			n -= i + 1;
+		} else {
+			n -= nr;
+		}
+	}
 }
 
-void tx_tstamp()
+static uint64_t replay_due(uint64_t k)
 {
-	char control[200];
-	struct cmsghdr *i;
-	char data[HEADERS_LEN + sizeof(struct payload)];
+	const struct replay_frame *r = replay->frames + k % replay->nr;
 
-	struct payload *payload = (struct payload *)(data + HEADERS_LEN);
+	if (!replay_speed)
+		return first_ns + k * interval_ns;
 
-	struct iovec iov = {
-		.iov_base = data,
-		.iov_len = sizeof(data)
-	};
+	return first_ns + ((k / replay->nr) * replay->period_ns + r->ts_ns) /
+		replay_speed;
+}
 
-	struct msghdr msg = {
-		.msg_control = control,
-		.msg_controllen = sizeof(control),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-	};
+/* Frame k as the i-th of a batch, id pktnum + i.  1 if it is tagged */
+static int replay_frame(uint64_t k, int i, struct io_frame *f,
+			struct iovec *v, const struct timespec *ts)
+{
+	const struct replay_frame *r = replay->frames + k % replay->nr;
+	uint8_t *data = (uint8_t *)replay->map + r->off;
+	struct replay_buf *b = replay_bufs + i;
+	unsigned int len = PAYLOAD_LEN(payload_ts);
+
+	f->iov = v;
+	f->id = pktnum + i;
+	if (r->room < len) {
+		v[0] = (struct iovec) { data, r->len };
+		f->iovlen = 1;
+		return 0;
+	}
 
-	int err;
+	memcpy(b->hdr, data, HEADERS_LEN);
+	((struct udphdr *)(b->hdr + HEADERS_LEN) - 1)->check = 0;
+	b->payload.hdr.seq = pktnum + i;
+	b->payload.hdr.flowid = flowid;
+	b->payload.hdr.magic = payload_ts ? MAGIC_TS : MAGIC;
+	b->payload.tx_ns = ts->tv_sec * 1000000000ull + ts->tv_nsec;
+
+	v[0] = (struct iovec) { b, HEADERS_LEN + len };
+	v[1] = (struct iovec) { data + HEADERS_LEN + len,
+				r->len - HEADERS_LEN - len };
+	f->iovlen = 2;
+	return 1;
+}
 
-	err = recvmsg(sockfd, &msg, MSG_ERRQUEUE);
-	if (err == -1) {
-		if (errno == EAGAIN)
-			return;
-		perror("recvmsg");
-		ERR("can't recvmsg(ERRQUEUE)");
+static void replay_tick(uint64_t now)
+{
+	struct io_frame f[IO_BATCH];
+	struct iovec v[IO_BATCH][2];
+	int tagged[IO_BATCH];
+	struct timespec ts;
+	uint64_t due, end;
+	int b, i, nr, ret;
+
+	for (b = 0; b < REPLAY_BATCHES; ++b) {
+		user_time(&ts);
+		for (nr = 0; nr < IO_BATCH; ++nr) {
+			due = replay_due(replay_next + nr);
+			if (due > now)
+				break;
+			if (due + interval_ns + REPLAY_TICK_NS < now)
+				health.catchup++;
+			tagged[nr] = replay_frame(replay_next + nr, nr,
+						  f + nr, v[nr], &ts);
+		}
+		if (!nr)
+			break;
+
+		ret = io->ops->send_batch(io, f, nr);
+		for (i = 0; i < ret; ++i, ++replay_next) {
+			PROBE(tx_send, pktnum, flowid,
+			      ts.tv_sec, ts.tv_nsec, 1);
+			frame_sent(&ts, tagged[i]);
+		}
+
+		/* The failed frame is dropped, the ones after it are
+		 * tagged again on the next tick */
+		if (i < nr) {
+			PROBE(tx_send, pktnum, flowid,
+			      ts.tv_sec, ts.tv_nsec, -1);
+			send_failed();
+			++replay_next;
+			break;
+		}
 	}
+	if (!running)
+		return;
 
-	struct scm_timestamping *tss = 0;
-	struct timespec *soft, *hard, *result;
+	/* When behind, leave the main loop as much time as the tick
+	 * took: the timestamps and snapshots are done there */
+	end = mono_ns();
+	now = end + (end - now > REPLAY_TICK_NS ? end - now : REPLAY_TICK_NS);
+	due = replay_due(replay_next);
+	arm_timer(due > now ? due : now);
+}
 
-	for_cmsg(i, &msg)
-		if (i->cmsg_level == SOL_SOCKET &&
-		    i->cmsg_type == SCM_TIMESTAMPING)
-			tss = (struct scm_timestamping *) CMSG_DATA(i);
+static void send_frame(int sugnum)
+{
+	struct timespec ts;
+	uint64_t now, due, late;
 
-	if (!tss)
+	/* SIGALRM may be already pending when the trial stops */
+	if (!running)
 		return;
 
-	soft = tss->ts;
-	hard = tss->ts + 2;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (!ts_empty(&stop_at) && !ts_before(&ts, &stop_at)) {
+		/* Keep running: timestamps are still coming */
+		stop_timer();
+		return;
+	}
 
-	if (!ts_empty(hard))
-		result = hard;
-	else if (!ts_empty(soft))
-		result = soft;
-	else
+	now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	if (replay) {
+		replay_tick(now);
 		return;
+	}
+
+	/* Slots due by now, this one included */
+	due = now < first_ns ? 1 : (now - first_ns) / interval_ns + 1;
+	late = due > slots + 1 ? due - slots - 1 : 0;
+
+	/* Burst up to catchup of the missed ones, skip the rest */
+	if (late > catchup) {
+		health.deficit += late - catchup;
+		slots += late - catchup;
+		late = catchup;
+	}
+	health.catchup += late;
+	slots += late + 1;
+
+	send_burst(late + 1);
+}
+
+static void publish(struct fseg *seg)
+{
+	uint32_t i;
+
+	for (i = 0; i < seg->len; ++i)
+		health.tstamps[seg->rec[i].src]++;
+	if (trace)
+		trace_array(trace, seg->rec, seg->len, flowid);
+	if (!payload_ts)
+		ring_send(seg->rec, seg->len, master_ring);
+	seg->len = 0;
+}
+
+static void take_stats()
+{
+	struct fseg *old = sent + sent_active;
+	uint64_t start = mono_ns();
+
+	if (stopping) {
+		running = 0;
+		stop_timer();
+		if (io->ops->stop)
+			io->ops->stop(io);
+		give_up_all(old);
+	}
 
-	if (!result)
+	sent_active ^= 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	publish(old);
+	publish(&tstamps);
+	health_snapshot(&health, start);
+	ctl->health = health;
+	ring_commit(master_ring);
+	stopping = 0;
+}
+
+static void send_stats(int signum)
+{
+	if (guard_try(&guard))
+		take_stats();
+}
+
+static void stop(int signum)
+{
+	INFO("stopping");
+	stopping = 1;
+	send_stats(signum);
+}
+
+void tx_tstamp()
+{
+	struct io_tstamp t;
+	struct timespec *result;
+	enum ts_src src;
+	struct pending *p;
+	uint32_t key;
+	int err, skip;
+
+	err = io->ops->tstamp(io, &t);
+	if (err <= 0) {
+		if (err)
+			health.errqueue_bad++;
 		return;
+	}
 
-	mask(&signals);
-	fl_push(&stat, payload->seq, result);
-	umask(&signals);
+	if (!ts_empty(&t.hw)) {
+		result = &t.hw;
+		src = TS_HW;
+	} else if (!ts_empty(&t.sw)) {
+		result = &t.sw;
+		src = TS_SW;
+	} else {
+		return;
+	}
+
+	p = pending + (t.id & PENDING_MASK);
+	key = t.id + 1;
+	PROBE(tx_tstamp, t.id, flowid, result->tv_sec, result->tv_nsec, src);
+
+	guard_enter(&guard);
+	if (src == TS_HW || src == final_src) {
+		/* Before the key: SIGALRM clears it before reusing skip */
+		skip = p->skip;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_compare_exchange_n(&p->key, &key, 0, 0,
+						 __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED))
+			health.ts_late++;
+		else if (!skip)
+			fs_push(&tstamps, t.id, result, src);
+	} else {
+		/* SIGALRM may reuse the slot meanwhile, kkey says */
+		p->kts = *result;
+		p->ksrc = src;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		p->kkey = key;
+	}
+	if (guard_leave(&guard))
+		take_stats();
 }
 
 /*
- * Main tx entry point
+ * Trial control
  */
 
-int tx(header_cfg_t *header, ethrate_t rate,
-       unsigned int fsz, unsigned int fid, int out)
+static int start()
 {
-	master_pipe = out;
-	flowid = fid;
-	fsize = fsz;
+	header = ctl->header;
+	flowid = ctl->flowid;
+	fsize = ctl->fsize;
 	pktnum = 0;
-	fl_clear(&stat);
+	stop_at = ctl->stop_at;
+	payload_ts = ctl->payload_ts;
+	catchup = ctl->catchup;
+	replay_speed = ctl->pcap_speed;
+	replay_next = 0;
+	tsc_anchor();
+
+	if (replay && replay_speed && !replay->period_ns) {
+		ERR("tx_pcap_speed: all frames of %s have the same time",
+		    ctl->pcap);
+		return 1;
+	}
 
-	setup_sock();
-	setup_frame(header);
-	setup_signals();
-	setup_timer(&rate);
+	sent[0].len = sent[1].len = 0;
+	tstamps.len = 0;
 
-	for(;;)
-		tx_tstamp();
+	/* The backend's ids restart at 0, as pktnum */
+	if (io->ops->start(io, !payload_ts))
+		return 1;
+	final_src = io->ops->hw_tstamp(io) ? TS_HW : TS_SW;
+	memset(pending, 0, (PENDING_MASK + 1) * sizeof(*pending));
+	memset(&health, 0, sizeof(health));
+	setup_frame();
+
+	if (setup_trace(ctl->trace))
+		return 1;
+
+	running = 1;
+	if (setup_timer(&ctl->rate, &ctl->start_at)) {
+		running = 0;
+		return 1;
+	}
 
 	return 0;
 }
+
+/* The io, the replay and the records, see slave_exit() */
+static void cleanup()
+{
+	timer_delete(timer);
+	io->ops->close(io);
+	if (replay)
+		replay_close(replay);
+	free(replay_bufs);
+	fs_free(sent);
+	fs_free(sent + 1);
+	fs_free(&tstamps);
+	free(pending);
+}
+
+/*
+ * Main tx entry point
+ */
+
+int tx(struct slave_ctl *c, struct ring *out)
+{
+	int err;
+
+	ctl = c;
+	master_ring = out;
+
+	if (slave_enter(ctl))
+		report_fail(1);
+
+	fs_init(sent);
+	fs_init(sent + 1);
+	fs_init(&tstamps);
+
+	pending = calloc(PENDING_MASK + 1, sizeof(*pending));
+	if (!pending) {
+		perror("calloc");
+		report_fail(1);
+	}
+
+	setup_io();
+	setup_replay();
+	setup_signals();
+	create_timer();
+	report_success(ctl);
+
+	for (;;) {
+		switch (slave_wait_cmd(ctl)) {
+		case CMD_START:
+			err = start();
+			slave_ack(ctl, err);
+			while (running) {
+				tx_tstamp();
+				tsc_tick();
+			}
+			trace_detach_close(&trace);
+			if (send_errno) {
+				errno = send_errno;
+				perror("send");
+				report_fail(1);
+			}
+			break;
+		case CMD_EXIT:
+			cleanup();
+			slave_ack(ctl, 0);
+			slave_exit(0);
+		default:
+			slave_ack(ctl, 1);
+		}
+	}
+}
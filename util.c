@@ -1,9 +1,14 @@
+#define _GNU_SOURCE /* mremap */
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/uio.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "util.h"
 
@@ -52,11 +57,12 @@ void fl_free(struct flist_head *head)
 }
 
 void fl_push(struct flist_head *head, uint32_t id,
-	     const struct timespec *ts)
+	     const struct timespec *ts, enum ts_src src)
 {
 	struct flist_entry *new = malloc(sizeof(struct flist_entry));
 	assert(new);
 	new->fdata.id = id;
+	new->fdata.src = src;
 	new->fdata.ts = *ts;
 	new->next = NULL;
 
@@ -224,11 +230,15 @@ void fl_uniq(struct flist_head *head)
 			} else {
 				fl_rm(i);
 			}
+			head->size--;
 		} else {
 			prev = i;
 			i = i->next;
 		}
 	}
+
+	head->first = dummy.next;
+	head->last = i;
 }
 
 void fl_merge(struct flist_head *left, struct flist_head *right,
@@ -360,3 +370,273 @@ int fl_recv_append(int fd, struct flist_head *head)
 
 	return 0;
 }
+
+/* Frame segment */
+
+#define FS_INIT_CAP (1 << 16)
+
+static void fs_grow(struct fseg *seg, uint32_t cap)
+{
+	struct fdata *new;
+
+	new = mremap(seg->rec, seg->cap * sizeof(*seg->rec),
+		     cap * sizeof(*seg->rec), MREMAP_MAYMOVE);
+	if (new == MAP_FAILED) {
+		perror("mremap(fseg)");
+		exit(1);
+	}
+	seg->rec = new;
+	seg->cap = cap;
+}
+
+void fs_init(struct fseg *seg)
+{
+	seg->len = 0;
+	seg->cap = FS_INIT_CAP;
+	seg->rec = mmap(NULL, seg->cap * sizeof(*seg->rec),
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (seg->rec == MAP_FAILED) {
+		perror("mmap(fseg)");
+		exit(1);
+	}
+}
+
+void fs_push(struct fseg *seg, uint32_t id,
+	     const struct timespec *ts, enum ts_src src)
+{
+	struct fdata *new;
+
+	if (seg->len == seg->cap)
+		fs_grow(seg, 2 * seg->cap);
+
+	new = seg->rec + seg->len;
+	new->id = id;
+	new->src = src;
+	new->ts = *ts;
+
+	/* Visible to signal handlers only when complete */
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	seg->len++;
+}
+
+void fs_free(struct fseg *seg)
+{
+	if (seg->rec)
+		munmap(seg->rec, seg->cap * sizeof(*seg->rec));
+	seg->rec = NULL;
+	seg->len = seg->cap = 0;
+}
+
+void fs_reserve(struct fseg *seg, uint32_t nr)
+{
+	uint32_t cap;
+
+	if (!seg->rec)
+		fs_init(seg);
+	cap = seg->cap;
+
+	while (cap - seg->len < nr)
+		cap *= 2;
+	if (cap != seg->cap)
+		fs_grow(seg, cap);
+}
+
+static int fdata_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const struct fdata *)a)->id;
+	uint32_t y = ((const struct fdata *)b)->id;
+
+	return (x > y) - (x < y);
+}
+
+static int fs_sorted(const struct fdata *rec, uint32_t nr)
+{
+	uint32_t i;
+
+	for (i = 1; i < nr; ++i)
+		if (rec[i].id < rec[i - 1].id)
+			return 0;
+	return 1;
+}
+
+/* Earlier of two records of the same id */
+static int fs_before(const struct fdata *a, const struct fdata *b)
+{
+	return a->ts.tv_sec < b->ts.tv_sec ||
+		(a->ts.tv_sec == b->ts.tv_sec && a->ts.tv_nsec < b->ts.tv_nsec);
+}
+
+/* Drop repeated ids from rec[from] on, rec[from - 1] included */
+static void fs_uniq(struct fseg *seg, uint32_t from)
+{
+	struct fdata *rec = seg->rec;
+	uint32_t i, out;
+
+	if (from)
+		--from;
+	if (seg->len - from < 2)
+		return;
+
+	for (out = from, i = from + 1; i < seg->len; ++i) {
+		if (rec[i].id != rec[out].id)
+			rec[++out] = rec[i];
+		else if (fs_before(rec + i, rec + out))
+			rec[out] = rec[i];
+	}
+	seg->len = out + 1;
+}
+
+/*
+ * Snapshots are mostly in order already: only the start of the new
+ * records overlaps the end of the old ones, frames whose timestamp
+ * came late.  Just that overlap is merged, through a copy of its old
+ * part.
+ */
+void fs_merge_tail(struct fseg *seg, uint32_t old)
+{
+	struct fdata *rec = seg->rec, *left;
+	uint32_t lo, hi, mid, i, j, w, nl;
+
+	if (seg->len == old)
+		return;
+
+	if (!fs_sorted(rec + old, seg->len - old))
+		qsort(rec + old, seg->len - old, sizeof(*rec), fdata_cmp);
+
+	if (!old || rec[old - 1].id <= rec[old].id) {
+		fs_uniq(seg, old);
+		return;
+	}
+
+	/* First old record past the first new one */
+	lo = 0;
+	hi = old;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rec[mid].id <= rec[old].id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	nl = old - lo;
+	left = malloc(nl * sizeof(*left));
+	if (!left) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(left, rec + lo, nl * sizeof(*left));
+
+	/* Never overtakes the new records it reads: w <= old + j */
+	for (i = 0, j = old, w = lo; i < nl; ++w) {
+		if (j < seg->len && rec[j].id < left[i].id)
+			rec[w] = rec[j++];
+		else
+			rec[w] = left[i++];
+	}
+	free(left);
+
+	fs_uniq(seg, lo);
+}
+
+/* return ts1 - ts2 */
+static double fs_ts_sub(const struct timespec *ts1,
+			const struct timespec *ts2)
+{
+	return (double)(ts1->tv_sec - ts2->tv_sec) +
+		(double)1e-9 * (ts1->tv_nsec - ts2->tv_nsec);
+}
+
+double fs_latency(const struct fseg *rx, const struct fseg *tx)
+{
+	uint32_t i = 0, j = 0;
+	double lat = 0;
+
+	while (i < rx->len && j < tx->len) {
+		if (rx->rec[i].id == tx->rec[j].id)
+			lat += fs_ts_sub(&rx->rec[i++].ts, &tx->rec[j++].ts);
+		else if (tx->rec[j].id < rx->rec[i].id)
+			++j;
+		else
+			++i;
+	}
+
+	return lat;
+}
+
+/* sysfs */
+
+char *read_line(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	char *ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	ret = fgets(buf, len, f);
+	fclose(f);
+	if (ret)
+		buf[strcspn(buf, "\n")] = 0;
+	return ret;
+}
+
+/* NUMA */
+
+int if_numa_node(const char *ifname)
+{
+	char path[128], buf[16];
+
+	snprintf(path, sizeof(path),
+		 "/sys/class/net/%s/device/numa_node", ifname);
+
+	/* Virtual devices have no numa_node, single node boxes say -1 */
+	if (!read_line(path, buf, sizeof(buf)))
+		return -1;
+
+	return atoi(buf);
+}
+
+char *node_cpulist(int node, char *buf, size_t len)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+
+	return read_line(path, buf, len);
+}
+
+#define NODE_MASK_LONGS 16
+
+int numa_bind(void *addr, size_t len, int node)
+{
+	unsigned long mask[NODE_MASK_LONGS] = {};
+
+	if (node < 0 || node >= NODE_MASK_LONGS * 64)
+		return 1;
+
+	mask[node / 64] = 1ul << (node % 64);
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED,
+		    mask, NODE_MASK_LONGS * 64, 0))
+		return perror("mbind"), 1;
+
+	return 0;
+}
+
+int numa_prefer(int node)
+{
+	unsigned long mask[NODE_MASK_LONGS] = {};
+
+	if (node < 0 || node >= NODE_MASK_LONGS * 64)
+		return 1;
+
+	mask[node / 64] = 1ul << (node % 64);
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED,
+		    mask, NODE_MASK_LONGS * 64))
+		return perror("set_mempolicy"), 1;
+
+	return 0;
+}
@@ -1,5 +1,7 @@
 /* Without this limits.h do not define IOV_MAX */
+#ifndef __USE_XOPEN
 #define __USE_XOPEN
+#endif
 #include <limits.h>
 
 /*
@@ -7,14 +9,23 @@
  * stored in lists/arrays
  */
 
+/* Where the timestamp came from */
+enum ts_src {
+	TS_USER,		/* clock_gettime() */
+	TS_SW,			/* kernel software timestamp */
+	TS_HW,			/* NIC hardware timestamp */
+};
+
 struct fdata {
 	uint32_t id;
+	uint8_t src;		/* enum ts_src */
 	struct timespec ts;
 };
 
 
 /*
- * Frame list implementation
+ * Frame list implementation.  The stat path uses struct fseg below;
+ * the list is left for list_test/ and programs built on it.
  */
 
 struct flist_entry {
@@ -36,7 +47,8 @@ void fl_clear(struct flist_head *head);
 void fl_alloc(struct flist_head *head, int size);
 
 /* Push new item to the end of the list */
-void fl_push(struct flist_head *head, uint32_t id, const struct timespec *ts);
+void fl_push(struct flist_head *head, uint32_t id,
+	     const struct timespec *ts, enum ts_src src);
 
 /* Send the whole list to fd */
 int fl_send(struct flist_head *head, int fd);
@@ -63,3 +75,81 @@ int fl_recv_append(int fd, struct flist_head *head);
 /* Free memory used by the list */
 void fl_free(struct flist_head *head);
 
+
+/*
+ * Frame segment: array of records for the slaves' hot paths.
+ * Memory comes from mmap/mremap, not malloc, so a segment may
+ * grow inside a signal handler.
+ */
+
+struct fseg {
+	struct fdata *rec;
+	uint32_t len, cap;
+};
+
+/* Map empty segment */
+void fs_init(struct fseg *seg);
+
+/* Append item, growing the segment if needed */
+void fs_push(struct fseg *seg, uint32_t id,
+	     const struct timespec *ts, enum ts_src src);
+
+/* Unmap segment */
+void fs_free(struct fseg *seg);
+
+/*
+ * The master keeps the records of a slave in a segment too, sorted
+ * by id with one record per id.  A zeroed segment is a valid empty
+ * one there.
+ */
+
+/* Room for nr more records */
+void fs_reserve(struct fseg *seg, uint32_t nr);
+
+/* Sort the records from old on and merge them into the sorted ones
+ * before, keeping the earliest record of an id */
+void fs_merge_tail(struct fseg *seg, uint32_t old);
+
+/* Summed latency of the ids in both, in seconds */
+double fs_latency(const struct fseg *rx, const struct fseg *tx);
+
+
+
+/*
+ * Futex on a word in (possibly shared) memory
+ */
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Sleep while *addr == val, timeout may be NULL */
+static inline void futex_wait(uint32_t *addr, uint32_t val,
+			      const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* First line of a (sysfs) file without the newline, NULL on error */
+char *read_line(const char *path, char *buf, size_t len);
+
+/*
+ * NUMA placement, straight from sysfs and syscalls
+ */
+
+/* Node the interface's device is attached to, -1 if unknown */
+int if_numa_node(const char *ifname);
+
+/* CPU list of the node like "0-7,16-23", NULL on error */
+char *node_cpulist(int node, char *buf, size_t len);
+
+/* Prefer node for pages of [addr, addr + len) */
+int numa_bind(void *addr, size_t len, int node);
+
+/* Prefer node for memory the calling thread allocates */
+int numa_prefer(int node);